@@ -4,26 +4,116 @@
 
 #define HAL_ASYNC_HPP_HAVE_SEEN
 
-#include "hal-pipe.hpp"
+#include "hal-executor.hpp"
+#include "hal-future.hpp"
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+#include "hal-trace.hpp"
 
-#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
 #include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include <pthread.h>
+
+// the block runs later on the executor, so it captures by value (this
+// included) rather than by reference to locals that are gone by then, C++20
+// deprecates the implicit capture of this by [=].
+#if __cplusplus >= 202002L
+#define HAL_ASYNC_CAPTURE [=, this]
+#else
+#define HAL_ASYNC_CAPTURE [=]
+#endif
 
 #define HAL_ASYNC_CALL(block)                                                  \
   do {                                                                         \
-    std::function<void()> functor{[&]() mutable { (block); }};                 \
-    this->write(std::ref(functor));                                            \
+    this->write(HAL_ASYNC_CAPTURE() mutable { (block); });                     \
   } while (false)
 
-class Hal_Async : public Hal_Pipe<std::function<void()>> {
+/**
+ * Hal_Async runs the tasks written to it one at a time and in order, but it
+ * does not own a thread, it is a strand on a Hal_Executor that is shared by
+ * many Hal_Async objects (the process wide default executor if none given).
+ *
+ * At most one executor task per Hal_Async is queued or running at any time,
+ * it runs up to kBatchSize tasks and re-posts itself if more are pending, so
+ * a busy Hal_Async does not starve others sharing the same executor. Its
+ * tasks are recorded under its name in a Hal_Trace.
+ *
+ * The futures returned by call() may outlive the Hal_Async, a then() or
+ * onReady() continuation that becomes ready after it is destroyed is dropped
+ * (failing the future of a then() step), as are the tasks still queued.
+ */
+class Hal_Async {
+  using Task = Hal_Task<void()>;
+
+  static constexpr int kBatchSize = 64;
+
 public:
-  Hal_Async(std::string_view name)
-      : Hal_Pipe{name, [](std::function<void()> &&task) {
-                   task();
-                   Hal_Proc::yield();
-                 }} {}
+  Hal_Async(std::string_view name,
+            Hal_Executor &executor = Hal_Executor::getDefault())
+      : m_executor{executor}, m_link{std::make_shared<Link>()},
+        m_traceName{Hal_Trace::intern(name)} {
+    int err{};
+
+    err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_emptyCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_link->async = this;
+  }
+
+  virtual ~Hal_Async() noexcept try {
+    std::deque<Hal_Async::Task> dropped{};
+
+    // the futures can no longer post to us
+    int err = pthread_mutex_lock(&m_link->mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_link->async = nullptr;
+
+    err = pthread_mutex_unlock(&m_link->mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    // drop the tasks that are not run yet and wait for the executor to
+    // release us, as the executor task refers to this object.
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    dropped.swap(m_queue);
+
+    while (m_scheduled) {
+      err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    pthread_mutex_unlock(&m_mutex);
+
+    // without the mutex, as a dropped call() task fails its future, which
+    // may post (and drop) the continuation
+    dropped.clear();
 
-  ~Hal_Async() noexcept try {
+    pthread_cond_destroy(&m_emptyCond);
+    pthread_mutex_destroy(&m_mutex);
   } catch (...) {
     // explicit return to resolve exception as destructor must be noexcept
     return;
@@ -33,6 +123,194 @@ public:
   const Hal_Async &operator=(const Hal_Async &halAsync) = delete;
   Hal_Async(Hal_Async &&halAsync) = delete;
   Hal_Async &operator=(Hal_Async &&halAsync) = delete;
+
+  void write(Hal_Async::Task task) {
+    bool schedule{};
+
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_queue.push_back(std::move(task));
+
+    if (!m_scheduled) {
+      m_scheduled = true;
+      schedule = true;
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (schedule) {
+      m_executor.post([this]() { run(); });
+    }
+  }
+
+  /**
+   * Queues fn like write(), and returns the future of its result, so the
+   * caller can wait on this one task or chain the next step to it.
+   */
+  template <typename Fn> auto call(Fn fn) {
+    using R = std::invoke_result_t<Fn &>;
+
+    auto state = std::make_shared<Hal_FutureState<R>>(
+        Hal_FutureContext{m_link, &Hal_Async::post});
+
+    write([promise = Hal_FuturePromise<R>{state},
+           fn = std::move(fn)]() mutable { promise.run(fn); });
+
+    return Hal_Future<R>{state};
+  }
+
+  void waitForEmpty() {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    while (m_scheduled) {
+      err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+private:
+  // what the futures of call() post their continuations through, async is
+  // null once the Hal_Async is being destroyed.
+  struct Link {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    Hal_Async *async{};
+
+    ~Link() { pthread_mutex_destroy(&mutex); }
+  };
+
+  static void post(void *target, Hal_Async::Task task) {
+    Link *link = static_cast<Link *>(target);
+
+    int err = pthread_mutex_lock(&link->mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (nullptr != link->async) {
+      try {
+        link->async->write(std::move(task));
+      } catch (...) {
+        pthread_mutex_unlock(&link->mutex);
+
+        throw;
+      }
+    }
+
+    err = pthread_mutex_unlock(&link->mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    // a task not written is dropped on return, without the mutex
+  }
+
+  void run() {
+    for (int i = 0; i <= kBatchSize; ++i) {
+      Hal_Async::Task task{};
+
+      int err = pthread_mutex_lock(&m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      if (m_queue.empty() || kBatchSize == i) {
+        bool reschedule = !m_queue.empty();
+
+        if (!reschedule) {
+          m_scheduled = false;
+
+          err = pthread_cond_broadcast(&m_emptyCond);
+          if (err) {
+            pthread_mutex_unlock(&m_mutex);
+
+            throw std::runtime_error(strerror(err));
+          }
+        }
+
+        err = pthread_mutex_unlock(&m_mutex);
+        if (err) {
+          throw std::runtime_error(strerror(err));
+        }
+
+        if (reschedule) {
+          m_executor.post([this]() { run(); });
+        }
+
+        return;
+      }
+
+      task = std::move(m_queue.front());
+      m_queue.pop_front();
+
+      err = pthread_mutex_unlock(&m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessBegin);
+
+      try {
+        task();
+      } catch (...) {
+        Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessEnd);
+
+        unschedule();
+
+        throw;
+      }
+
+      Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessEnd);
+    }
+  }
+
+  // the executor thread is unwinding (e.g. asked to stop), so the strand is
+  // not re-posted, and the tasks left run when the next write posts it, or
+  // else it would never be scheduled again and ~Hal_Async would hang.
+  void unschedule() {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_scheduled = false;
+
+    err = pthread_cond_broadcast(&m_emptyCond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  Hal_Executor &m_executor;
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_emptyCond{};
+  std::deque<Hal_Async::Task> m_queue{};
+  bool m_scheduled{};
+  std::shared_ptr<Link> m_link{};
+
+  const uint32_t m_traceName{};
 };
 
 #endif /* HAL_ASYNC_HPP_HAVE_SEEN */
@@ -0,0 +1,96 @@
+/**
+ * This program counts heap allocations per async call, for a typical
+ * HAL_ASYNC_CALL closure (a this pointer, a captured std::string and a long),
+ * wrapped and queued as std::function (how Hal_Async queued its tasks before
+ * Hal_Task) and as Hal_Task, and end to end through Hal_Async::write().
+ */
+
+#include "hal-async.hpp"
+#include "hal-task.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+
+static std::atomic<long long> allocCount{};
+
+void *operator new(std::size_t size) {
+  allocCount.fetch_add(1, std::memory_order_relaxed);
+
+  void *ptr = std::malloc(size ? size : 1);
+  if (nullptr == ptr) {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+class Hal_Counter {
+public:
+  void add(const std::string &source, long value) {
+    m_count += value + source.size();
+  }
+
+  long long m_count{};
+};
+
+template <typename Task> double queueAndRun(Hal_Counter &counter, long calls) {
+  std::deque<Task> queue{};
+  std::string source{"sensor_input"};
+  long long before = allocCount.load();
+
+  for (long i = 0; i < calls; i++) {
+    Task task{[pCounter = &counter, source, i]() { pCounter->add(source, i); }};
+
+    queue.push_back(std::move(task));
+    queue.front()();
+    queue.pop_front();
+  }
+
+  return (double)(allocCount.load() - before) / calls;
+}
+
+double asyncWrite(Hal_Counter &counter, long calls) {
+  Hal_Async async{"bench"};
+  std::string source{"sensor_input"};
+
+  async.write([]() {});
+  async.waitForEmpty();
+
+  long long before = allocCount.load();
+
+  for (long i = 0; i < calls; i++) {
+    async.write(
+        [pCounter = &counter, source, i]() { pCounter->add(source, i); });
+  }
+
+  async.waitForEmpty();
+
+  return (double)(allocCount.load() - before) / calls;
+}
+
+int main(int argc, char *argv[]) {
+  long calls = 100000;
+  Hal_Counter counter{};
+
+  if (argc > 1) {
+    calls = strtol(argv[1], NULL, 10);
+  }
+
+  std::cout << "allocations per call, " << calls << " calls\n";
+  std::cout << "std::function + std::deque: "
+            << queueAndRun<std::function<void()>>(counter, calls) << "\n";
+  std::cout << "Hal_Task + std::deque: "
+            << queueAndRun<Hal_Task<void()>>(counter, calls) << "\n";
+  std::cout << "Hal_Async::write: " << asyncWrite(counter, calls) << "\n";
+
+  return counter.m_count > 0 ? 0 : 1;
+}
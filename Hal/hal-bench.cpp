@@ -0,0 +1,334 @@
+/**
+ * This program measures throughput (items/s) and enqueue to dequeue latency
+ * (p50/p99/p999) of the Hal queues and pipes, with one producer thread
+ * writing as fast as it can (no sleep_for pacing) and payloads from a long
+ * to a 1 KB string:
+ *
+ * - buffer: Hal_Buffer, one producer and one consumer thread, with the
+ *   block, spin-then-park and busy-poll wait strategies, and with 1, 2 and 4
+ *   producer threads.
+ * - sharded-buffer: Hal_ShardedBuffer with 1, 2 and 4 producer threads.
+ * - limit-buffer: Hal_LimitBuffer at capacity 1, 16, 256 and 4096, and at
+ *   capacity 16 with each wait strategy.
+ * - pipe-chain: 1, 2 and 4 Hal_Pipe stages, each stage writes to the next.
+ * - teepipe: Hal_TeePipe with 1, 2 and 4 sources, one producer per source.
+ * - async: Hal_Async::write of a task per item on the default executor.
+ *
+ * The results are printed as CSV (one header line, one line per run), e.g.
+ * "make hal-bench > baseline.csv", and the number of items per run can be
+ * given as the first argument.
+ */
+
+#include "hal-async.hpp"
+#include "hal-buffer.hpp"
+#include "hal-limit-buffer.hpp"
+#include "hal-metrics.hpp"
+#include "hal-pipe.hpp"
+#include "hal-proc.hpp"
+#include "hal-sharded-buffer.hpp"
+#include "hal-teepipe.hpp"
+#include "hal-wait-strategy.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+template <typename P> struct Hal_BenchItem {
+  uint64_t stamp{};
+  P payload{};
+};
+
+class Hal_BenchRun {
+public:
+  Hal_BenchRun(std::string bench, std::string payload, std::string config,
+               long items)
+      : m_bench{std::move(bench)}, m_payload{std::move(payload)},
+        m_config{std::move(config)}, m_latencies(items) {}
+
+  void start() { m_start = Hal_Metrics::now(); }
+
+  // called by one thread at a time, in the order the items are consumed
+  void consumed(uint64_t stamp) {
+    m_latencies[m_count++] = Hal_Metrics::now() - stamp;
+  }
+
+  void report() {
+    uint64_t end = Hal_Metrics::now();
+    double seconds = (end - m_start) / 1e9;
+
+    std::sort(m_latencies.begin(), m_latencies.begin() + m_count);
+
+    std::cout << m_bench << "," << m_payload << "," << m_config << ","
+              << m_count << "," << seconds << "," << (long)(m_count / seconds)
+              << "," << percentile(50) << "," << percentile(99) << ","
+              << percentile(99.9) << "\n";
+  }
+
+  static void printHeader() {
+    std::cout << "bench,payload,config,items,seconds,items_per_sec,"
+                 "p50_ns,p99_ns,p999_ns\n";
+  }
+
+private:
+  uint64_t percentile(double p) const {
+    if (0 == m_count) {
+      return 0;
+    }
+
+    size_t index = (size_t)(p / 100.0 * (m_count - 1));
+
+    return m_latencies[index];
+  }
+
+  const std::string m_bench{};
+  const std::string m_payload{};
+  const std::string m_config{};
+  std::vector<uint64_t> m_latencies{};
+  size_t m_count{};
+  uint64_t m_start{};
+};
+
+template <typename Buffer, typename P>
+void benchBuffer(Hal_BenchRun &run, Buffer &buffer, long items,
+                 const P &payload) {
+  Hal_Proc consumer{"bench-consumer", [&run, &buffer, items]() {
+                      for (long i = 0; i < items; i++) {
+                        Hal_BenchItem<P> item = buffer.pop();
+
+                        run.consumed(item.stamp);
+                      }
+                    }};
+
+  run.start();
+  consumer.exec();
+
+  for (long i = 0; i < items; i++) {
+    Hal_BenchItem<P> item{Hal_Metrics::now(), payload};
+
+    buffer.push(item);
+  }
+
+  consumer.wait();
+  run.report();
+}
+
+// the producer threads push items / producers items each, and the calling
+// thread consumes them.
+template <typename Buffer, typename P>
+void benchProducers(Hal_BenchRun &run, Buffer &buffer, size_t producers,
+                    long items, const P &payload) {
+  long count = items / (long)producers;
+  std::vector<std::unique_ptr<Hal_Proc>> procs{};
+
+  for (size_t i = 0; i < producers; i++) {
+    procs.push_back(std::make_unique<Hal_Proc>(
+        "bench-producer-" + std::to_string(i), [&buffer, count, &payload]() {
+          for (long j = 0; j < count; j++) {
+            Hal_BenchItem<P> item{Hal_Metrics::now(), payload};
+
+            buffer.push(item);
+          }
+        }));
+  }
+
+  run.start();
+
+  for (auto &proc : procs) {
+    proc->exec();
+  }
+
+  for (long i = 0; i < count * (long)producers; i++) {
+    Hal_BenchItem<P> item = buffer.pop();
+
+    run.consumed(item.stamp);
+  }
+
+  for (auto &proc : procs) {
+    proc->wait();
+  }
+
+  run.report();
+}
+
+template <typename P>
+void benchPipeChain(Hal_BenchRun &run, size_t stages, long items,
+                    const P &payload) {
+  using Pipe = Hal_Pipe<Hal_BenchItem<P>>;
+
+  std::vector<std::unique_ptr<Pipe>> chain(stages);
+
+  for (size_t i = stages; i-- > 0;) {
+    std::string name = "bench-stage-" + std::to_string(i);
+
+    if (stages - 1 == i) {
+      chain[i] = std::make_unique<Pipe>(
+          name, [&run](Hal_BenchItem<P> &&item) { run.consumed(item.stamp); });
+    } else {
+      Pipe *next = chain[i + 1].get();
+
+      chain[i] = std::make_unique<Pipe>(
+          name, [next](Hal_BenchItem<P> &&item) { next->write(item); });
+    }
+  }
+
+  run.start();
+
+  for (long i = 0; i < items; i++) {
+    Hal_BenchItem<P> item{Hal_Metrics::now(), payload};
+
+    chain[0]->write(item);
+  }
+
+  for (auto &pipe : chain) {
+    pipe->waitForEmpty();
+  }
+
+  run.report();
+}
+
+template <typename P>
+void benchTeePipe(Hal_BenchRun &run, size_t sources, long items,
+                  const P &payload) {
+  Hal_TeePipe<Hal_BenchItem<P>> teePipe{
+      "bench-teepipe",
+      [&run](Hal_BenchItem<P> item) { run.consumed(item.stamp); }};
+  std::vector<std::unique_ptr<Hal_Proc>> producers{};
+
+  for (size_t i = 0; i < sources; i++) {
+    auto source = teePipe.addHal_TeePipeSource(64);
+
+    producers.push_back(std::make_unique<Hal_Proc>(
+        "bench-source-" + std::to_string(i),
+        [&teePipe, source, count = items / (long)sources, &payload]() mutable {
+          for (long j = 0; j < count; j++) {
+            Hal_BenchItem<P> item{Hal_Metrics::now(), payload};
+
+            source->write(item);
+          }
+
+          teePipe.removeHal_TeePipeSource(source);
+        }));
+  }
+
+  run.start();
+
+  for (auto &producer : producers) {
+    producer->exec();
+  }
+
+  for (auto &producer : producers) {
+    producer->wait();
+  }
+
+  teePipe.waitForEmpty();
+  run.report();
+}
+
+template <typename P>
+void benchAsync(Hal_BenchRun &run, long items, const P &payload) {
+  Hal_Async async{"bench-async"};
+
+  run.start();
+
+  for (long i = 0; i < items; i++) {
+    async.write([&run, stamp = Hal_Metrics::now(), payload]() {
+      run.consumed(stamp);
+    });
+  }
+
+  async.waitForEmpty();
+  run.report();
+}
+
+template <typename P>
+void benchPayload(const std::string &name, const P &payload, long items) {
+  const std::pair<std::string, Hal_WaitStrategy> waitStrategies[] = {
+      {"block", Hal_WaitStrategy::block()},
+      {"spin-then-park", Hal_WaitStrategy::spinThenPark()},
+      {"busy-poll", Hal_WaitStrategy::busyPoll()}};
+
+  for (auto &[wait, waitStrategy] : waitStrategies) {
+    Hal_BenchRun run{"buffer", name, "wait=" + wait, items};
+    Hal_Buffer<Hal_BenchItem<P>> buffer{waitStrategy};
+
+    benchBuffer(run, buffer, items, payload);
+  }
+
+  for (size_t producers : {1, 2, 4}) {
+    Hal_BenchRun run{"buffer", name, "producers=" + std::to_string(producers),
+                     items};
+    Hal_Buffer<Hal_BenchItem<P>> buffer{};
+
+    benchProducers(run, buffer, producers, items, payload);
+  }
+
+  for (size_t producers : {1, 2, 4}) {
+    Hal_BenchRun run{"sharded-buffer", name,
+                     "producers=" + std::to_string(producers), items};
+    Hal_ShardedBuffer<Hal_BenchItem<P>> buffer{};
+
+    benchProducers(run, buffer, producers, items, payload);
+  }
+
+  for (size_t capacity : {1, 16, 256, 4096}) {
+    Hal_BenchRun run{"limit-buffer", name,
+                     "capacity=" + std::to_string(capacity), items};
+    Hal_LimitBuffer<Hal_BenchItem<P>> buffer{capacity};
+
+    benchBuffer(run, buffer, items, payload);
+  }
+
+  for (auto &[wait, waitStrategy] : waitStrategies) {
+    Hal_BenchRun run{"limit-buffer", name, "capacity=16 wait=" + wait, items};
+    Hal_LimitBuffer<Hal_BenchItem<P>> buffer{16, waitStrategy};
+
+    benchBuffer(run, buffer, items, payload);
+  }
+
+  for (size_t stages : {1, 2, 4}) {
+    Hal_BenchRun run{"pipe-chain", name, "stages=" + std::to_string(stages),
+                     items};
+
+    benchPipeChain(run, stages, items, payload);
+  }
+
+  for (size_t sources : {1, 2, 4}) {
+    Hal_BenchRun run{"teepipe", name, "sources=" + std::to_string(sources),
+                     items};
+
+    benchTeePipe(run, sources, items, payload);
+  }
+
+  {
+    Hal_BenchRun run{"async", name, "-", items};
+
+    benchAsync(run, items, payload);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long items = 100000;
+
+  if (argc > 1) {
+    items = strtol(argv[1], NULL, 10);
+  }
+
+  if (items <= 0) {
+    std::cerr << argv[0] << ": number of items must be positive\n";
+
+    return 1;
+  }
+
+  Hal_BenchRun::printHeader();
+
+  benchPayload("long", 42L, items);
+  benchPayload("string-64", std::string(64, 'x'), items);
+  benchPayload("string-1k", std::string(1024, 'x'), items);
+
+  return 0;
+}
@@ -0,0 +1,425 @@
+/**
+ * This module implements Hal_BroadcastPipe, the reverse of Hal_TeePipe: one
+ * stream of items that is read by any number of subscribers, each on its own
+ * Hal_Proc thread, instead of a copy of every item written to a Hal_Pipe per
+ * consumer.
+ *
+ * An item is written once, as a std::shared_ptr<const T>, to a ring of
+ * capacity slots, and every subscriber has its own cursor over the ring, so
+ * the subscribers share the one immutable item and can keep it (the
+ * shared_ptr) after their task returns. A subscriber takes all the items up
+ * to the head of the ring at once, and runs its task on them without the
+ * mutex.
+ *
+ * A slow subscriber either holds the writers back (Block, the default), so
+ * that every subscriber sees every item, or falls behind and, once a whole
+ * ring behind, skips to the oldest item still kept (Overwrite), so the
+ * writers and the other subscribers never wait for it. Either way lags()
+ * shows how far behind each subscriber is and how many items it skipped.
+ */
+
+#ifndef HAL_BROADCAST_PIPE_HPP_HAVE_SEEN
+
+#define HAL_BROADCAST_PIPE_HPP_HAVE_SEEN
+
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+#include "hal-trace.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+enum class Hal_BroadcastPolicy {
+  Block,     // write waits until the slowest subscriber frees a slot
+  Overwrite, // write never waits, a lapped subscriber skips items
+};
+
+struct Hal_BroadcastLag {
+  std::string subscriber{};
+  uint64_t lag{};     // items written that it has not finished
+  uint64_t skipped{}; // items overwritten before it took them
+};
+
+template <typename T> class Hal_BroadcastPipe {
+public:
+  using Item = std::shared_ptr<const T>;
+  using Task = Hal_Task<void(const Item &)>;
+
+  // 0 is never a subscriber id
+  using Id = uint64_t;
+
+  Hal_BroadcastPipe(std::string_view name, size_t capacity = 1024,
+                    Hal_BroadcastPolicy policy = Hal_BroadcastPolicy::Block)
+      : m_name{name}, m_policy{policy}, m_slots(capacity),
+        m_traceName{Hal_Trace::intern(name)} {
+    if (0 == capacity) {
+      throw std::invalid_argument("Hal_BroadcastPipe capacity must be > 0");
+    }
+
+    int err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_readableCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_writableCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_emptyCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  virtual ~Hal_BroadcastPipe() noexcept try {
+    // all asked at once so they stop together
+    for (auto &[id, subscriber] : m_subscribers) {
+      subscriber->proc->requestStop();
+    }
+
+    m_subscribers.clear();
+
+    pthread_cond_destroy(&m_emptyCond);
+    pthread_cond_destroy(&m_writableCond);
+    pthread_cond_destroy(&m_readableCond);
+    pthread_mutex_destroy(&m_mutex);
+  } catch (...) {
+    // explicit return to resolve exception as destructor must be noexcept
+    return;
+  }
+
+  Hal_BroadcastPipe(const Hal_BroadcastPipe &halBroadcastPipe) = delete;
+  const Hal_BroadcastPipe &
+  operator=(const Hal_BroadcastPipe &halBroadcastPipe) = delete;
+  Hal_BroadcastPipe(Hal_BroadcastPipe &&halBroadcastPipe) = delete;
+  Hal_BroadcastPipe &operator=(Hal_BroadcastPipe &&halBroadcastPipe) = delete;
+
+  /**
+   * Runs fn on a new thread named name for every item written from now on.
+   */
+  Hal_BroadcastPipe::Id subscribe(std::string_view name,
+                                  Hal_BroadcastPipe::Task fn) {
+    auto subscriber = std::make_unique<Subscriber>();
+    Subscriber *added = subscriber.get();
+
+    subscriber->name = std::string(name);
+    subscriber->fn = std::move(fn);
+    subscriber->traceName = Hal_Trace::intern(name);
+    subscriber->proc = std::make_unique<Hal_Proc>(name);
+
+    lock();
+
+    Hal_BroadcastPipe::Id id = m_nextId++;
+
+    subscriber->cursor = m_head;
+    subscriber->done = m_head;
+    m_subscribers.emplace(id, std::move(subscriber));
+
+    unlock();
+
+    added->proc->exec([this, added]() {
+      while (!Hal_Proc::stopRequested()) {
+        readAndProcess(*added);
+      }
+    });
+
+    return id;
+  }
+
+  /**
+   * Stops the thread of the subscriber after the task call that it is in
+   * the middle of, returns false if there is no such subscriber.
+   */
+  bool unsubscribe(Hal_BroadcastPipe::Id id) {
+    std::unique_ptr<Subscriber> subscriber{};
+
+    lock();
+
+    auto iter = m_subscribers.find(id);
+    if (iter != m_subscribers.end()) {
+      subscriber = std::move(iter->second);
+      m_subscribers.erase(iter);
+
+      // the writers may have been waiting for it
+      broadcast(&m_writableCond);
+      broadcast(&m_emptyCond);
+    }
+
+    unlock();
+
+    if (!subscriber) {
+      return false;
+    }
+
+    subscriber->proc->requestStop();
+    subscriber->proc->wait();
+
+    return true;
+  }
+
+  void write(T item) { write(std::make_shared<const T>(std::move(item))); }
+
+  template <typename... Args> void emplace(Args &&...args) {
+    write(std::make_shared<const T>(std::forward<Args>(args)...));
+  }
+
+  /**
+   * Writes item to every subscriber, an item may be written from more than
+   * one thread.
+   */
+  void write(Item item) {
+    if (!item) {
+      throw std::invalid_argument("Hal_BroadcastPipe item is null");
+    }
+
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Push);
+
+    lock();
+
+    if (Hal_BroadcastPolicy::Block == m_policy) {
+      waitForSlot();
+    }
+
+    m_slots[m_head % m_slots.size()] = std::move(item);
+    m_head++;
+
+    broadcast(&m_readableCond);
+    unlock();
+  }
+
+  /**
+   * Waits until every subscriber has finished (or skipped) the items
+   * written so far.
+   */
+  void waitForEmpty() {
+    lock();
+
+    uint64_t head = m_head;
+
+    m_emptyWaiters++;
+
+    while (!finished(head)) {
+      int err{};
+
+      try {
+        err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
+      } catch (const Hal_StopException &) {
+        m_emptyWaiters--;
+
+        throw;
+      }
+
+      if (err) {
+        m_emptyWaiters--;
+        unlock();
+
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    m_emptyWaiters--;
+
+    unlock();
+  }
+
+  std::vector<Hal_BroadcastLag> lags() {
+    std::vector<Hal_BroadcastLag> lags{};
+
+    lock();
+
+    for (auto &[id, subscriber] : m_subscribers) {
+      lags.push_back(Hal_BroadcastLag{subscriber->name,
+                                      m_head - subscriber->done,
+                                      subscriber->skipped});
+    }
+
+    unlock();
+
+    return lags;
+  }
+
+  size_t size() {
+    lock();
+    size_t count = m_subscribers.size();
+    unlock();
+
+    return count;
+  }
+
+  const std::string &getName() const { return m_name; }
+
+  Hal_BroadcastPolicy getPolicy() const { return m_policy; }
+
+private:
+  // guarded by m_mutex but fn and proc, which are set before the thread of
+  // the subscriber runs
+  struct Subscriber {
+    std::string name{};
+    Hal_BroadcastPipe::Task fn{};
+    uint32_t traceName{};
+    uint64_t cursor{};  // the next item to take
+    uint64_t done{};    // the items before it are finished or skipped
+    uint64_t skipped{};
+    std::unique_ptr<Hal_Proc> proc{};
+  };
+
+  void readAndProcess(Subscriber &subscriber) {
+    std::vector<Item> items{};
+
+    lock();
+
+    while (subscriber.cursor == m_head) {
+      int err = Hal_Proc::condWait(&m_readableCond, &m_mutex);
+      if (err) {
+        unlock();
+
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    // lapped, only the last ring of items is kept
+    if (m_head - subscriber.cursor > m_slots.size()) {
+      subscriber.skipped += m_head - m_slots.size() - subscriber.cursor;
+      subscriber.cursor = m_head - m_slots.size();
+    }
+
+    for (; subscriber.cursor < m_head; subscriber.cursor++) {
+      items.push_back(m_slots[subscriber.cursor % m_slots.size()]);
+    }
+
+    uint64_t taken = subscriber.cursor;
+
+    if (Hal_BroadcastPolicy::Block == m_policy && m_blockedWriters > 0) {
+      broadcast(&m_writableCond);
+    }
+
+    unlock();
+
+    Hal_Trace::record(subscriber.traceName, Hal_TraceEvent::Pop,
+                      items.size());
+    Hal_Trace::record(subscriber.traceName, Hal_TraceEvent::ProcessBegin,
+                      items.size());
+
+    for (auto &item : items) {
+      subscriber.fn(item);
+    }
+
+    Hal_Trace::record(subscriber.traceName, Hal_TraceEvent::ProcessEnd,
+                      items.size());
+
+    lock();
+
+    subscriber.done = taken;
+
+    if (m_emptyWaiters > 0) {
+      broadcast(&m_emptyCond);
+    }
+
+    unlock();
+  }
+
+  // with m_mutex held, until the slot of the head is taken by every
+  // subscriber
+  void waitForSlot() {
+    while (m_head - m_tail >= m_slots.size()) {
+      m_tail = m_head;
+
+      for (auto &[id, subscriber] : m_subscribers) {
+        m_tail = std::min(m_tail, subscriber->cursor);
+      }
+
+      if (m_head - m_tail < m_slots.size()) {
+        break;
+      }
+
+      m_blockedWriters++;
+
+      int err{};
+
+      try {
+        err = Hal_Proc::condWait(&m_writableCond, &m_mutex);
+      } catch (const Hal_StopException &) {
+        m_blockedWriters--;
+
+        throw;
+      }
+
+      m_blockedWriters--;
+
+      if (err) {
+        unlock();
+
+        throw std::runtime_error(strerror(err));
+      }
+    }
+  }
+
+  bool finished(uint64_t head) const {
+    for (auto &[id, subscriber] : m_subscribers) {
+      if (subscriber->done < head) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  void broadcast(pthread_cond_t *cond) {
+    int err = pthread_cond_broadcast(cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  void lock() {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  void unlock() {
+    int err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  const std::string m_name{};
+  const Hal_BroadcastPolicy m_policy{};
+
+  // guarded by m_mutex
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_readableCond{};
+  pthread_cond_t m_writableCond{};
+  pthread_cond_t m_emptyCond{};
+  std::vector<Item> m_slots{};
+  uint64_t m_head{}; // the items written
+  uint64_t m_tail{}; // the slowest cursor when it was last looked at
+  std::map<Hal_BroadcastPipe::Id, std::unique_ptr<Subscriber>> m_subscribers{};
+  Hal_BroadcastPipe::Id m_nextId{1};
+  int m_blockedWriters{};
+  int m_emptyWaiters{};
+
+  const uint32_t m_traceName{};
+};
+
+#endif /* HAL_BROADCAST_PIPE_HPP_HAVE_SEEN */
@@ -2,16 +2,32 @@
 
 #define HAL_BUFFER_HPP_HAVE_SEEN
 
+#include "hal-metrics.hpp"
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+#include "hal-wait-strategy.hpp"
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <deque>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <pthread.h>
 
+/**
+ * The wait strategy selects how pop and popBatch wait for an item, see
+ * Hal_WaitStrategy.
+ */
 template <typename T> class Hal_Buffer {
 public:
-  Hal_Buffer() {
+  Hal_Buffer(Hal_WaitStrategy waitStrategy = {})
+      : m_waitStrategy{waitStrategy} {
     int err{};
 
     err = pthread_mutex_init(&m_mutex, NULL);
@@ -41,19 +57,45 @@ public:
   Hal_Buffer(const Hal_Buffer<T> &&halBuffer) = delete;
   Hal_Buffer<T> &operator=(Hal_Buffer<T> &&halBuffer) = delete;
 
-  void push(T &rItem) {
+  // moves from rItem if T's move constructor does not throw, copies it
+  // otherwise.
+  void push(T &rItem) { emplace(std::move_if_noexcept(rItem)); }
+
+  void push(T &&item) { emplace(std::move(item)); }
+
+  /**
+   * Constructs the item in place in the queue from args.
+   */
+  template <typename... Args> void emplace(Args &&...args) {
     int err{};
+    uint64_t pushTime = m_metrics.stamp();
 
     err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
+    size_t size = m_queue.size();
+
+    try {
+      m_queue.emplace_back(std::forward<Args>(args)...);
+
+      if (m_metrics.isRecording()) {
+        m_pushTimes.push_back(pushTime);
+      }
+    } catch (...) {
+      if (m_queue.size() > size) {
+        m_queue.pop_back();
+      }
+
+      pthread_mutex_unlock(&m_mutex);
 
-    m_queue.push_back(std::move_if_noexcept(rItem));
+      throw;
+    }
 
     ++m_pushCount;
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.pushed(1, m_queue.size());
 
     err = pthread_cond_signal(&m_cond);
     if (err) {
@@ -62,10 +104,66 @@ public:
       throw std::runtime_error(strerror(err));
     }
 
+    std::vector<Hal_Task<void()>> readableTasks{};
+    readableTasks.swap(m_readableTasks);
+
     err = pthread_mutex_unlock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
+
+    for (auto &task : readableTasks) {
+      task();
+    }
+  }
+
+  template <typename InputIt> void pushBatch(InputIt first, InputIt last) {
+    int err{};
+    uint64_t pushTime = m_metrics.stamp();
+    long long pushCount{};
+
+    if (first == last) {
+      return;
+    }
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    pushCount = m_pushCount;
+
+    for (; first != last; ++first) {
+      m_queue.push_back(std::move_if_noexcept(*first));
+
+      if (m_metrics.isRecording()) {
+        m_pushTimes.push_back(pushTime);
+      }
+
+      ++m_pushCount;
+    }
+
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.pushed(m_pushCount - pushCount, m_queue.size());
+
+    err = pthread_cond_broadcast(&m_cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    std::vector<Hal_Task<void()>> readableTasks{};
+    readableTasks.swap(m_readableTasks);
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    for (auto &task : readableTasks) {
+      task();
+    }
   }
 
   long long waitForEmpty() {
@@ -77,15 +175,13 @@ public:
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
-
     while (!m_queue.empty()) {
-      err = pthread_cond_wait(&m_emptyCond, &m_mutex);
+      err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
       if (err) {
         throw std::runtime_error(strerror(err));
       }
 
-      pthread_testcancel();
+      m_metrics.woken();
     }
 
     assert(m_popCount == m_pushCount);
@@ -102,26 +198,168 @@ public:
   T pop() {
     int err{};
 
+    Hal_WaitStrategy waitStrategy = getWaitStrategy();
+    auto ready = [this]() {
+      return m_size.load(std::memory_order_acquire) > 0;
+    };
+
+    waitStrategy.spin(ready);
+
     err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
+    while (m_queue.empty()) {
+      err = waitStrategy.park(&m_cond, &m_mutex, ready);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    }
+
+    return popFront();
+  }
+
+  /**
+   * The next item if there is one, without waiting.
+   */
+  std::optional<T> popNoWait() {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (m_queue.empty()) {
+      err = pthread_mutex_unlock(&m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      return {};
+    }
+
+    return popFront();
+  }
+
+  /**
+   * Lets a consumer that has no thread to block (e.g. a coroutine) wait for
+   * an item: returns false if there is an item already, else keeps fn and
+   * returns true, and the next push calls fn once, on the pushing thread
+   * without the mutex, so fn should only hand off (e.g. post to an
+   * executor). Every kept fn is called, so a consumer that then finds the
+   * buffer empty asks again.
+   */
+  bool notifyWhenReadable(Hal_Task<void()> fn) {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    bool empty = m_queue.empty();
+    if (empty) {
+      m_readableTasks.push_back(std::move(fn));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    return empty;
+  }
+
+  std::vector<T> popBatch(size_t maxItems) {
+    int err{};
+    std::vector<T> items{};
+
+    assert(maxItems > 0);
+
+    Hal_WaitStrategy waitStrategy = getWaitStrategy();
+    auto ready = [this]() {
+      return m_size.load(std::memory_order_acquire) > 0;
+    };
+
+    waitStrategy.spin(ready);
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
 
     while (m_queue.empty()) {
-      err = pthread_cond_wait(&m_cond, &m_mutex);
+      err = waitStrategy.park(&m_cond, &m_mutex, ready);
       if (err) {
         throw std::runtime_error(strerror(err));
       }
 
-      pthread_testcancel();
+      m_metrics.woken();
     }
 
+    size_t count = std::min(maxItems, m_queue.size());
+    items.reserve(count);
+    std::move(m_queue.begin(), m_queue.begin() + count,
+              std::back_inserter(items));
+    m_queue.erase(m_queue.begin(), m_queue.begin() + count);
+
+    if (m_metrics.isRecording()) {
+      uint64_t popTime = Hal_Metrics::now();
+      for (size_t i = 0; i < count; i++) {
+        m_metrics.dequeued(m_pushTimes[i], popTime);
+      }
+
+      m_pushTimes.erase(m_pushTimes.begin(), m_pushTimes.begin() + count);
+    }
+
+    m_popCount += count;
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.popped(count);
+
+    err = pthread_cond_signal(&m_emptyCond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    return items;
+  }
+
+  Hal_Metrics &metrics() { return m_metrics; }
+
+  Hal_WaitStrategy getWaitStrategy() const {
+    return m_waitStrategy.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Takes effect at the next wait of a consumer.
+   */
+  void setWaitStrategy(Hal_WaitStrategy waitStrategy) {
+    m_waitStrategy.store(waitStrategy, std::memory_order_relaxed);
+  }
+
+private:
+  // with the mutex held, pops the front item and releases the mutex.
+  T popFront() {
+    int err{};
+
     T val = std::move(m_queue.front());
     m_queue.pop_front();
 
+    if (m_metrics.isRecording()) {
+      m_metrics.dequeued(m_pushTimes.front(), Hal_Metrics::now());
+      m_pushTimes.pop_front();
+    }
+
     ++m_popCount;
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.popped(1);
 
     err = pthread_cond_signal(&m_emptyCond);
     if (err) {
@@ -139,13 +377,19 @@ public:
                 // by default for efficient copy.
   }
 
-private:
   std::deque<T> m_queue{};
+  std::deque<uint64_t> m_pushTimes{}; // empty unless metrics are recorded
   pthread_mutex_t m_mutex{};
   pthread_cond_t m_cond{};
   pthread_cond_t m_emptyCond{};
   long long m_pushCount{};
   long long m_popCount{};
+  Hal_Metrics m_metrics{};
+  std::vector<Hal_Task<void()>> m_readableTasks{};
+
+  // the queue size for the lock free polls of a spinning consumer
+  std::atomic<size_t> m_size{};
+  std::atomic<Hal_WaitStrategy> m_waitStrategy{};
 };
 
 #endif /* HAL_BUFFER_HPP_HAVE_SEEN */
@@ -0,0 +1,412 @@
+/**
+ * This module implements C++20 coroutines over the Hal pipes, buffers and
+ * async objects, so that many logical stages can wait on Hal queues without
+ * a blocked thread (and its stack) each, e.g.
+ *
+ *   Hal_CoTask<> stage(Hal_Pipe<int> &in, Hal_LimitBuffer<int> &out) {
+ *     for (int item = 0; item >= 0;) {
+ *       item = co_await Hal_CoRead(in);
+ *       co_await Hal_CoPush(out, item * 2);
+ *     }
+ *   }
+ *
+ *   Hal_CoSpawn(executor, stage(in, out));
+ *
+ * A Hal_CoTask starts when it is co_awaited or spawned, and a coroutine that
+ * has to wait is suspended and resumed later by a task posted to its
+ * Hal_Executor, so a handful of executor threads run any number of
+ * coroutines. co_await of a Hal_Future (e.g. of Hal_Async::call) resumes
+ * the coroutine once the result is ready.
+ *
+ * A suspended coroutine does not see a Hal_Proc stop request, it is ended by
+ * what it reads (e.g. an end marker). It needs -std=c++20, the header is
+ * empty for an earlier standard.
+ */
+
+#ifndef HAL_CORO_HPP_HAVE_SEEN
+
+#define HAL_CORO_HPP_HAVE_SEEN
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include "hal-executor.hpp"
+#include "hal-future.hpp"
+#include "hal-limit-buffer.hpp"
+#include "hal-proc.hpp"
+
+#include <chrono>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include <pthread.h>
+
+template <typename T = void> class Hal_CoTask;
+
+class Hal_CoPromiseBase {
+  template <typename T> friend class Hal_CoTask;
+
+  friend void Hal_CoSpawn(Hal_Executor &executor, Hal_CoTask<void> task);
+
+public:
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    // resumes the coroutine awaiting this one on the same thread, or frees
+    // a spawned coroutine that nobody awaits.
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      Hal_CoPromiseBase &promise = handle.promise();
+
+      if (promise.m_continuation) {
+        return promise.m_continuation;
+      }
+
+      if (promise.m_spawned) {
+        handle.destroy();
+      }
+
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() {
+    // nobody can get the exception of a spawned coroutine, so it ends the
+    // process as it would from a std::thread.
+    if (m_spawned) {
+      std::terminate();
+    }
+
+    m_exception = std::current_exception();
+  }
+
+  Hal_Executor &getExecutor() const {
+    return nullptr == m_executor ? Hal_Executor::getDefault() : *m_executor;
+  }
+
+  /**
+   * Resumes the coroutine on a thread of its executor.
+   */
+  template <typename Promise>
+  static void resume(std::coroutine_handle<Promise> handle) {
+    handle.promise().getExecutor().post([handle]() { handle.resume(); });
+  }
+
+protected:
+  void rethrow() const {
+    if (m_exception) {
+      std::rethrow_exception(m_exception);
+    }
+  }
+
+private:
+  Hal_Executor *m_executor{};
+  std::coroutine_handle<> m_continuation{};
+  std::exception_ptr m_exception{};
+  bool m_spawned{};
+};
+
+template <typename T> class Hal_CoPromise : public Hal_CoPromiseBase {
+public:
+  template <typename U> void return_value(U &&value) {
+    m_value.emplace(std::forward<U>(value));
+  }
+
+  T result() {
+    rethrow();
+
+    return std::move(*m_value);
+  }
+
+private:
+  std::optional<T> m_value{};
+};
+
+template <> class Hal_CoPromise<void> : public Hal_CoPromiseBase {
+public:
+  void return_void() {}
+
+  void result() { rethrow(); }
+};
+
+/**
+ * The coroutine return type, it owns the coroutine until it is spawned, and
+ * co_await of it runs the coroutine on the executor of the awaiting one and
+ * returns its co_return value (or rethrows its exception).
+ */
+template <typename T> class Hal_CoTask {
+  friend void Hal_CoSpawn(Hal_Executor &executor, Hal_CoTask<void> task);
+
+public:
+  class promise_type : public Hal_CoPromise<T> {
+  public:
+    Hal_CoTask get_return_object() {
+      return Hal_CoTask{
+          std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+  };
+
+  using Handle = std::coroutine_handle<promise_type>;
+
+  class Awaiter {
+  public:
+    explicit Awaiter(Handle handle) : m_handle{handle} {}
+
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> awaiting) noexcept {
+      m_handle.promise().m_executor = &awaiting.promise().getExecutor();
+      m_handle.promise().m_continuation = awaiting;
+
+      return m_handle;
+    }
+
+    T await_resume() { return m_handle.promise().result(); }
+
+  private:
+    Handle m_handle{};
+  };
+
+  explicit Hal_CoTask(Handle handle) : m_handle{handle} {}
+
+  ~Hal_CoTask() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+
+  Hal_CoTask(const Hal_CoTask &halCoTask) = delete;
+  const Hal_CoTask &operator=(const Hal_CoTask &halCoTask) = delete;
+
+  Hal_CoTask(Hal_CoTask &&halCoTask) noexcept
+      : m_handle{std::exchange(halCoTask.m_handle, {})} {}
+
+  Hal_CoTask &operator=(Hal_CoTask &&halCoTask) noexcept {
+    if (this != &halCoTask) {
+      if (m_handle) {
+        m_handle.destroy();
+      }
+
+      m_handle = std::exchange(halCoTask.m_handle, {});
+    }
+
+    return *this;
+  }
+
+  Awaiter operator co_await() && {
+    if (!m_handle) {
+      throw std::logic_error("Hal_CoTask has no coroutine");
+    }
+
+    return Awaiter{m_handle};
+  }
+
+private:
+  Handle m_handle{};
+};
+
+/**
+ * Starts task on executor without waiting for it, the coroutine frame is
+ * freed when it returns.
+ */
+inline void Hal_CoSpawn(Hal_Executor &executor, Hal_CoTask<void> task) {
+  if (!task.m_handle) {
+    throw std::logic_error("Hal_CoTask has no coroutine");
+  }
+
+  auto handle = std::exchange(task.m_handle, {});
+
+  handle.promise().m_executor = &executor;
+  handle.promise().m_spawned = true;
+
+  Hal_CoPromiseBase::resume(handle);
+}
+
+/**
+ * Suspends the coroutine until notify (e.g. notifyWhenReadable of a buffer)
+ * calls the task it is given, and does not suspend at all if notify returns
+ * false.
+ */
+template <typename Notify> class Hal_CoNotified {
+public:
+  explicit Hal_CoNotified(Notify notify) : m_notify{std::move(notify)} {}
+
+  bool await_ready() noexcept { return false; }
+
+  template <typename Promise>
+  bool await_suspend(std::coroutine_handle<Promise> handle) {
+    // the coroutine may be resumed (and this awaiter gone) before notify
+    // returns, so it is called from a copy.
+    Notify notify = m_notify;
+
+    return notify([handle]() { Hal_CoPromiseBase::resume(handle); });
+  }
+
+  void await_resume() noexcept {}
+
+private:
+  Notify m_notify;
+};
+
+/**
+ * Reads the next item of a pipe (anything with readNoWait and
+ * notifyWhenReadable, e.g. a Hal_Pipe over a Hal_Buffer or
+ * Hal_LimitBuffer) without a pipe thread.
+ */
+template <typename Pipe>
+auto Hal_CoRead(Pipe &pipe)
+    -> Hal_CoTask<typename decltype(pipe.readNoWait())::value_type> {
+  for (;;) {
+    auto item = pipe.readNoWait();
+    if (item) {
+      co_return std::move(*item);
+    }
+
+    co_await Hal_CoNotified{[&pipe](Hal_Task<void()> fn) {
+      return pipe.notifyWhenReadable(std::move(fn));
+    }};
+  }
+}
+
+/**
+ * Pops the next item of a buffer (anything with popNoWait and
+ * notifyWhenReadable, e.g. Hal_Buffer or Hal_LimitBuffer).
+ */
+template <typename Buffer>
+auto Hal_CoPop(Buffer &buffer)
+    -> Hal_CoTask<typename decltype(buffer.popNoWait())::value_type> {
+  for (;;) {
+    auto item = buffer.popNoWait();
+    if (item) {
+      co_return std::move(*item);
+    }
+
+    co_await Hal_CoNotified{[&buffer](Hal_Task<void()> fn) {
+      return buffer.notifyWhenReadable(std::move(fn));
+    }};
+  }
+}
+
+/**
+ * Pushes item to buffer, suspending while the buffer is full with the Block
+ * overflow policy, and returns the push status of the other policies.
+ */
+template <typename T>
+Hal_CoTask<Hal_PushStatus> Hal_CoPush(Hal_LimitBuffer<T> &buffer, T item) {
+  for (;;) {
+    Hal_PushStatus status =
+        buffer.pushFor(item, std::chrono::nanoseconds::zero());
+    if (Hal_PushStatus::TimedOut != status) {
+      co_return status;
+    }
+
+    co_await Hal_CoNotified{[&buffer](Hal_Task<void()> fn) {
+      return buffer.notifyWhenWritable(std::move(fn));
+    }};
+  }
+}
+
+template <typename T> class Hal_CoFutureAwaiter {
+public:
+  explicit Hal_CoFutureAwaiter(Hal_Future<T> future)
+      : m_future{std::move(future)} {}
+
+  bool await_ready() noexcept { return false; }
+
+  template <typename Promise>
+  void await_suspend(std::coroutine_handle<Promise> handle) {
+    m_future.onReady([handle]() { Hal_CoPromiseBase::resume(handle); });
+  }
+
+  T await_resume() { return m_future.get(); }
+
+private:
+  Hal_Future<T> m_future;
+};
+
+/**
+ * co_await of a Hal_Future, e.g. co_await async.call(fn).
+ */
+template <typename T>
+Hal_CoFutureAwaiter<T> operator co_await(Hal_Future<T> &&future) {
+  return Hal_CoFutureAwaiter<T>{std::move(future)};
+}
+
+/**
+ * Runs task on executor and blocks the calling thread (which must not be a
+ * thread of executor) until it returns, e.g. from main.
+ */
+template <typename T>
+T Hal_CoWait(Hal_Executor &executor, Hal_CoTask<T> task) {
+  using Value = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+  struct State {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    bool done{};
+    std::optional<Value> value{};
+    std::exception_ptr exception{};
+  } state{};
+
+  auto run = [](Hal_CoTask<T> task, State &state) -> Hal_CoTask<void> {
+    try {
+      if constexpr (std::is_void_v<T>) {
+        co_await std::move(task);
+        state.value.emplace();
+      } else {
+        state.value.emplace(co_await std::move(task));
+      }
+    } catch (...) {
+      state.exception = std::current_exception();
+    }
+
+    pthread_mutex_lock(&state.mutex);
+    state.done = true;
+    pthread_cond_signal(&state.cond);
+    pthread_mutex_unlock(&state.mutex);
+  };
+
+  Hal_CoSpawn(executor, run(std::move(task), state));
+
+  int err = pthread_mutex_lock(&state.mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  while (!state.done) {
+    err = Hal_Proc::condWait(&state.cond, &state.mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  pthread_mutex_unlock(&state.mutex);
+  pthread_cond_destroy(&state.cond);
+  pthread_mutex_destroy(&state.mutex);
+
+  if (state.exception) {
+    std::rethrow_exception(state.exception);
+  }
+
+  if constexpr (!std::is_void_v<T>) {
+    return std::move(*state.value);
+  }
+}
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* HAL_CORO_HPP_HAVE_SEEN */
@@ -0,0 +1,220 @@
+#include "hal-executor.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <pthread.h>
+
+// the worker that the calling thread runs, if it is a worker of any executor.
+static thread_local void *t_worker{};
+
+Hal_Executor::Hal_Executor(std::string_view name, size_t workers)
+    : m_name{name} {
+  int err{};
+
+  if (0 == workers) {
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  err = pthread_mutex_init(&m_mutex, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  err = pthread_cond_init(&m_cond, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  for (size_t i = 0; i < workers; ++i) {
+    auto worker = std::make_unique<Worker>();
+
+    worker->executor = this;
+    worker->index = i;
+
+    err = pthread_mutex_init(&worker->mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_workers.push_back(std::move(worker));
+  }
+
+  // start the workers only after all deques exist, as a worker steals from
+  // every other worker.
+  for (auto &worker : m_workers) {
+    Worker *pWorker = worker.get();
+
+    worker->proc = std::make_unique<Hal_Proc>(
+        m_name + "-" + std::to_string(worker->index),
+        [this, pWorker]() { runWorker(*pWorker); });
+    worker->proc->exec();
+  }
+}
+
+Hal_Executor::~Hal_Executor() noexcept try {
+  // stop all workers before destroying any deque, an idle worker may be in
+  // the middle of stealing from another worker.
+  for (auto &worker : m_workers) {
+    worker->proc->requestStop();
+  }
+
+  for (auto &worker : m_workers) {
+    worker->proc = {};
+  }
+
+  for (auto &worker : m_workers) {
+    pthread_mutex_destroy(&worker->mutex);
+  }
+
+  pthread_cond_destroy(&m_cond);
+  pthread_mutex_destroy(&m_mutex);
+} catch (...) {
+  // explicit return to resolve exception as destructor must be noexcept
+  return;
+}
+
+void Hal_Executor::post(Hal_Executor::Task fn) {
+  int err{};
+  Worker *worker = static_cast<Worker *>(t_worker);
+
+  if (nullptr == worker || worker->executor != this) {
+    worker = m_workers[m_next.fetch_add(1, std::memory_order_relaxed) %
+                       m_workers.size()]
+                 .get();
+  }
+
+  err = pthread_mutex_lock(&worker->mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  worker->tasks.push_back(std::move(fn));
+
+  err = pthread_mutex_unlock(&worker->mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  // announce the task before checking for sleeping workers, a parking worker
+  // announces itself before checking for pending tasks, so one of us always
+  // sees the other.
+  m_pending.fetch_add(1, std::memory_order_seq_cst);
+
+  if (m_sleeping.load(std::memory_order_seq_cst) > 0) {
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_signal(&m_cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+}
+
+size_t Hal_Executor::size() const { return m_workers.size(); }
+
+Hal_Executor &Hal_Executor::getDefault() {
+  static Hal_Executor executor{"hal-executor"};
+
+  return executor;
+}
+
+bool Hal_Executor::takeTask(Worker &worker, Hal_Executor::Task &fn) {
+  int err{};
+  size_t count = m_workers.size();
+
+  // own deque first (front), then the other deques (back) starting from the
+  // next worker so that the thieves do not all hit the same victim.
+  for (size_t i = 0; i < count; ++i) {
+    Worker &victim = *m_workers[(worker.index + i) % count];
+
+    err = pthread_mutex_lock(&victim.mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    bool found = !victim.tasks.empty();
+    if (found) {
+      if (&victim == &worker) {
+        fn = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+      } else {
+        fn = std::move(victim.tasks.back());
+        victim.tasks.pop_back();
+      }
+    }
+
+    err = pthread_mutex_unlock(&victim.mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (found) {
+      m_pending.fetch_sub(1, std::memory_order_relaxed);
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Hal_Executor::runWorker(Worker &worker) {
+  t_worker = &worker;
+
+  while (!Hal_Proc::stopRequested()) {
+    int err{};
+    Hal_Executor::Task fn{};
+
+    if (takeTask(worker, fn)) {
+      fn();
+
+      continue;
+    }
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_sleeping.fetch_add(1, std::memory_order_seq_cst);
+
+    while (m_pending.load(std::memory_order_seq_cst) <= 0) {
+      try {
+        err = Hal_Proc::condWait(&m_cond, &m_mutex);
+      } catch (const Hal_StopException &) {
+        m_sleeping.fetch_sub(1, std::memory_order_relaxed);
+
+        throw;
+      }
+
+      if (err) {
+        m_sleeping.fetch_sub(1, std::memory_order_relaxed);
+
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    m_sleeping.fetch_sub(1, std::memory_order_relaxed);
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+}
@@ -0,0 +1,73 @@
+/**
+ * This module implements a pool of Hal_Proc worker threads that many objects
+ * (e.g. Hal_Async) share instead of owning one thread each.
+ *
+ * Every worker owns a deque of tasks, a task posted from a worker thread goes
+ * into that worker's deque and a task posted from any other thread is spread
+ * round robin across the workers. A worker takes tasks from the front of its
+ * own deque and, when it runs dry, steals from the back of the other workers'
+ * deques before it parks, so an idle core picks up work queued behind a busy
+ * one.
+ */
+
+#ifndef HAL_EXECUTOR_HPP_HAVE_SEEN
+
+#define HAL_EXECUTOR_HPP_HAVE_SEEN
+
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+
+class Hal_Executor {
+  using Task = Hal_Task<void()>;
+
+  struct Worker {
+    Hal_Executor *executor{};
+    size_t index{};
+    pthread_mutex_t mutex{};
+    std::deque<Hal_Executor::Task> tasks{};
+    std::unique_ptr<Hal_Proc> proc{};
+  };
+
+public:
+  Hal_Executor(std::string_view name, size_t workers = 0);
+  virtual ~Hal_Executor() noexcept;
+
+  Hal_Executor(const Hal_Executor &halExecutor) = delete;
+  const Hal_Executor &operator=(const Hal_Executor &halExecutor) = delete;
+  Hal_Executor(Hal_Executor &&halExecutor) = delete;
+  Hal_Executor &operator=(Hal_Executor &&halExecutor) = delete;
+
+  void post(Hal_Executor::Task fn);
+
+  size_t size() const;
+
+  /**
+   * The process wide executor with one worker per core, it is the default
+   * executor of Hal_Async.
+   */
+  static Hal_Executor &getDefault();
+
+private:
+  void runWorker(Worker &worker);
+  bool takeTask(Worker &worker, Hal_Executor::Task &fn);
+
+  const std::string m_name{};
+  std::vector<std::unique_ptr<Worker>> m_workers{};
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_cond{};
+  std::atomic<size_t> m_next{};
+  std::atomic<long long> m_pending{};
+  std::atomic<int> m_sleeping{};
+};
+
+#endif /* HAL_EXECUTOR_HPP_HAVE_SEEN */
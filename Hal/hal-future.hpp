@@ -0,0 +1,322 @@
+/**
+ * This module implements Hal_Future, the result handle of Hal_Async::call().
+ * The caller can wait on exactly its own task (get() or wait()) instead of
+ * draining the whole Hal_Async queue with waitForEmpty(), or chain the next
+ * step with then(), which runs as a new task on the same Hal_Async once the
+ * result is ready, without blocking any thread.
+ *
+ * An exception thrown by the task is captured and rethrown by get(), and it
+ * is passed down a then() chain without calling the later steps. A task (or
+ * then() step) that is dropped without being run, e.g. still queued when its
+ * Hal_Async is destroyed, fails its future with a broken promise error, so
+ * get() and wait() never block forever.
+ */
+
+#ifndef HAL_FUTURE_HPP_HAVE_SEEN
+
+#define HAL_FUTURE_HPP_HAVE_SEEN
+
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include <pthread.h>
+
+/**
+ * Where the continuations of a Hal_Future run, e.g. a Hal_Async strand. The
+ * futures share the ownership of target, which outlives what it posts to, so
+ * post drops the task (failing what it would complete) once that is gone.
+ */
+struct Hal_FutureContext {
+  std::shared_ptr<void> target{};
+  void (*post)(void *target, Hal_Task<void()> task){};
+};
+
+template <typename T> class Hal_FutureState {
+  using Value = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+  template <typename U> friend class Hal_Future;
+
+public:
+  Hal_FutureState(Hal_FutureContext context) : m_context{context} {
+    int err{};
+
+    err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_cond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  ~Hal_FutureState() {
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  Hal_FutureState(const Hal_FutureState &halFutureState) = delete;
+  const Hal_FutureState &
+  operator=(const Hal_FutureState &halFutureState) = delete;
+  Hal_FutureState(Hal_FutureState &&halFutureState) = delete;
+  Hal_FutureState &operator=(Hal_FutureState &&halFutureState) = delete;
+
+  template <typename Fn> void run(Fn &fn) {
+    try {
+      if constexpr (std::is_void_v<T>) {
+        fn();
+        complete(std::monostate{}, {});
+      } else {
+        complete(fn(), {});
+      }
+    } catch (const Hal_StopException &) {
+      // the waiters of the future are not left hanging, but the stop still
+      // unwinds the thread that runs the task
+      complete({}, std::current_exception());
+
+      throw;
+    } catch (...) {
+      complete({}, std::current_exception());
+    }
+  }
+
+  void fail(std::exception_ptr exception) { complete({}, exception); }
+
+private:
+  void complete(std::optional<Value> value, std::exception_ptr exception) {
+    Hal_Task<void()> continuation{};
+
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_value = std::move(value);
+    m_exception = exception;
+    m_ready = true;
+    continuation = std::move(m_continuation);
+
+    err = pthread_cond_broadcast(&m_cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (continuation) {
+      m_context.post(m_context.target.get(), std::move(continuation));
+    }
+  }
+
+  void setContinuation(Hal_Task<void()> continuation) {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    bool ready = m_ready;
+    if (!ready) {
+      m_continuation = std::move(continuation);
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (ready) {
+      m_context.post(m_context.target.get(), std::move(continuation));
+    }
+  }
+
+  void wait() {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    while (!m_ready) {
+      err = Hal_Proc::condWait(&m_cond, &m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  const Hal_FutureContext m_context{};
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_cond{};
+  bool m_ready{};
+  std::optional<Value> m_value{};
+  std::exception_ptr m_exception{};
+  Hal_Task<void()> m_continuation{};
+};
+
+/**
+ * The right to complete a Hal_FutureState, held by the task that completes
+ * it. If the task is destroyed without being run, it fails the future with a
+ * broken promise error rather than leave its waiters waiting forever.
+ */
+template <typename T> class Hal_FuturePromise {
+public:
+  explicit Hal_FuturePromise(std::shared_ptr<Hal_FutureState<T>> state)
+      : m_state{std::move(state)} {}
+
+  ~Hal_FuturePromise() noexcept try {
+    if (m_state) {
+      m_state->fail(std::make_exception_ptr(
+          std::runtime_error("Hal_Future broken promise")));
+    }
+  } catch (...) {
+    // explicit return to resolve exception as destructor must be noexcept
+    return;
+  }
+
+  Hal_FuturePromise(const Hal_FuturePromise &halFuturePromise) = delete;
+  const Hal_FuturePromise &
+  operator=(const Hal_FuturePromise &halFuturePromise) = delete;
+  Hal_FuturePromise(Hal_FuturePromise &&halFuturePromise) noexcept = default;
+  Hal_FuturePromise &
+  operator=(Hal_FuturePromise &&halFuturePromise) = delete;
+
+  template <typename Fn> void run(Fn &fn) {
+    auto state = std::move(m_state);
+    state->run(fn);
+  }
+
+  void fail(std::exception_ptr exception) {
+    auto state = std::move(m_state);
+    state->fail(exception);
+  }
+
+private:
+  std::shared_ptr<Hal_FutureState<T>> m_state{};
+};
+
+template <typename T> class Hal_Future {
+  template <typename Fn, typename U> struct ThenResult {
+    using type = std::invoke_result_t<Fn &, U &&>;
+  };
+
+  template <typename Fn> struct ThenResult<Fn, void> {
+    using type = std::invoke_result_t<Fn &>;
+  };
+
+public:
+  Hal_Future() = default;
+  Hal_Future(std::shared_ptr<Hal_FutureState<T>> state)
+      : m_state{std::move(state)} {}
+
+  Hal_Future(const Hal_Future &halFuture) = delete;
+  const Hal_Future &operator=(const Hal_Future &halFuture) = delete;
+  Hal_Future(Hal_Future &&halFuture) = default;
+  Hal_Future &operator=(Hal_Future &&halFuture) = default;
+
+  bool valid() const { return nullptr != m_state; }
+
+  void wait() {
+    checkValid();
+
+    m_state->wait();
+  }
+
+  /**
+   * Blocks until the task is run, and returns its result (or rethrows its
+   * exception). The result is moved out, so get() is called at most once.
+   */
+  T get() {
+    checkValid();
+
+    auto state = std::move(m_state);
+    state->wait();
+
+    if (state->m_exception) {
+      std::rethrow_exception(state->m_exception);
+    }
+
+    if constexpr (!std::is_void_v<T>) {
+      return std::move(*state->m_value);
+    }
+  }
+
+  /**
+   * Calls fn as a new task on the same Hal_Async once the result is ready
+   * (at once if it is), get() then returns without blocking, e.g. to resume
+   * a coroutine waiting on the future. fn is dropped without being called if
+   * the Hal_Async is destroyed first.
+   */
+  void onReady(Hal_Task<void()> fn) {
+    checkValid();
+
+    // fn may get the result (and release the state) before we return
+    auto state = m_state;
+    state->setContinuation(std::move(fn));
+  }
+
+  /**
+   * Runs fn with the result (no argument if T is void) as a new task on the
+   * same Hal_Async when the result is ready, and returns the future of fn's
+   * result (a broken promise error if the Hal_Async is destroyed first).
+   * This future is no longer valid afterward.
+   */
+  template <typename Fn> auto then(Fn fn) {
+    using R = typename ThenResult<Fn, T>::type;
+
+    checkValid();
+
+    auto state = std::move(m_state);
+    auto next = std::make_shared<Hal_FutureState<R>>(state->m_context);
+
+    state->setContinuation([state, promise = Hal_FuturePromise<R>{next},
+                            fn = std::move(fn)]() mutable {
+      if (state->m_exception) {
+        promise.fail(state->m_exception);
+
+        return;
+      }
+
+      auto step = [&state, &fn]() -> R {
+        if constexpr (std::is_void_v<T>) {
+          return fn();
+        } else {
+          return fn(std::move(*state->m_value));
+        }
+      };
+
+      promise.run(step);
+    });
+
+    return Hal_Future<R>{next};
+  }
+
+private:
+  void checkValid() const {
+    if (nullptr == m_state) {
+      throw std::logic_error("Hal_Future has no state");
+    }
+  }
+
+  std::shared_ptr<Hal_FutureState<T>> m_state{};
+};
+
+#endif /* HAL_FUTURE_HPP_HAVE_SEEN */
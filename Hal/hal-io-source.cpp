@@ -0,0 +1,529 @@
+#include "hal-io-source.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+void Hal_Framer::finish(std::string &bytes,
+                        std::vector<std::string> & /* records */) {
+  bytes.clear();
+}
+
+void Hal_LineFramer::frame(std::string &bytes,
+                           std::vector<std::string> &records) {
+  size_t start = 0;
+  size_t end{};
+
+  while ((end = bytes.find('\n', start)) != std::string::npos) {
+    records.emplace_back(bytes, start, end - start);
+    start = end + 1;
+  }
+
+  bytes.erase(0, start);
+}
+
+void Hal_LineFramer::finish(std::string &bytes,
+                            std::vector<std::string> &records) {
+  if (!bytes.empty()) {
+    records.push_back(std::move(bytes));
+    bytes.clear();
+  }
+}
+
+Hal_LengthPrefixFramer::Hal_LengthPrefixFramer(size_t prefixSize,
+                                               size_t maxRecordSize)
+    : m_prefixSize{prefixSize}, m_maxRecordSize{maxRecordSize} {
+  if (0 == m_prefixSize || m_prefixSize > sizeof(uint64_t)) {
+    throw std::invalid_argument("length prefix must be 1 to 8 bytes");
+  }
+}
+
+void Hal_LengthPrefixFramer::frame(std::string &bytes,
+                                   std::vector<std::string> &records) {
+  size_t start = 0;
+
+  while (bytes.size() - start >= m_prefixSize) {
+    uint64_t size{};
+
+    for (size_t i = 0; i < m_prefixSize; i++) {
+      size = (size << 8) | (unsigned char)bytes[start + i];
+    }
+
+    if (size > m_maxRecordSize) {
+      throw std::length_error("record is larger than the maximum size");
+    }
+
+    if (bytes.size() - start - m_prefixSize < size) {
+      break;
+    }
+
+    records.emplace_back(bytes, start + m_prefixSize, size);
+    start += m_prefixSize + size;
+  }
+
+  bytes.erase(0, start);
+}
+
+Hal_FixedSizeFramer::Hal_FixedSizeFramer(size_t recordSize)
+    : m_recordSize{recordSize} {
+  if (0 == m_recordSize) {
+    throw std::invalid_argument("record size must not be 0");
+  }
+}
+
+void Hal_FixedSizeFramer::frame(std::string &bytes,
+                                std::vector<std::string> &records) {
+  size_t start = 0;
+
+  for (; bytes.size() - start >= m_recordSize; start += m_recordSize) {
+    records.emplace_back(bytes, start, m_recordSize);
+  }
+
+  bytes.erase(0, start);
+}
+
+Hal_IoSource::Hal_IoSource(std::string_view name)
+    : Hal_Proc{name}, m_readBuffer(kReadSize) {
+  int err{};
+
+  err = pthread_mutex_init(&m_mutex, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  err = pthread_cond_init(&m_closedCond, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == m_epollFd) {
+    throw std::runtime_error(strerror(errno));
+  }
+
+  // wakes up the source thread for a removal or a stop, it is the only
+  // epoll event without an input.
+  m_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (-1 == m_wakeupFd) {
+    throw std::runtime_error(strerror(errno));
+  }
+
+  struct epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+
+  if (-1 == epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeupFd, &event)) {
+    throw std::runtime_error(strerror(errno));
+  }
+
+  exec([this]() { run(); });
+}
+
+Hal_IoSource::~Hal_IoSource() noexcept try {
+  stop();
+
+  close(m_wakeupFd);
+  close(m_epollFd);
+  pthread_cond_destroy(&m_closedCond);
+  pthread_mutex_destroy(&m_mutex);
+} catch (...) {
+  // explicit return to resolve exception as destructor must be noexcept
+  return;
+}
+
+Hal_IoSource::Id Hal_IoSource::add(int fd,
+                                   std::unique_ptr<Hal_Framer> framer,
+                                   Hal_IoSource::Task fn,
+                                   Hal_IoSource::CloseTask closeFn) {
+  // fn takes every record
+  return add(fd, std::move(framer),
+      Hal_IoSource::OfferTask{
+          [fn = std::move(fn)](std::vector<std::string> &records) {
+            size_t count = records.size();
+
+            fn(std::move(records));
+
+            return count;
+          }},
+      std::move(closeFn));
+}
+
+Hal_IoSource::Id Hal_IoSource::add(int fd,
+                                   std::unique_ptr<Hal_Framer> framer,
+                                   Hal_IoSource::OfferTask fn,
+                                   Hal_IoSource::CloseTask closeFn) {
+  auto input = std::make_unique<Input>();
+
+  input->fd = fd;
+  input->framer = std::move(framer);
+  input->fn = std::move(fn);
+  input->closeFn = std::move(closeFn);
+
+  return addInput(std::move(input));
+}
+
+Hal_IoSource::Id
+Hal_IoSource::addInput(std::unique_ptr<Hal_IoSource::Input> input) {
+  int fd = input->fd;
+  Input *pInput = input.get();
+
+  lock();
+
+  for (auto &[id, added] : m_inputs) {
+    if (added->fd == fd) {
+      unlock();
+
+      throw std::invalid_argument("fd is already added to Hal_IoSource");
+    }
+  }
+
+  Hal_IoSource::Id id = m_nextId++;
+  pInput->id = id;
+
+  // the input is complete before epoll can report it, as the source thread
+  // reads fd as soon as it is ready, which must not block
+  int flags = fcntl(fd, F_GETFL);
+  if (-1 != flags) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  pInput->pollable = true;
+  pInput->watched = true;
+  m_inputs[id] = std::move(input);
+
+  // a regular file can not be polled (EPERM), it is always readable, so the
+  // source thread reads it in every round until its end.
+  struct epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = pInput;
+
+  if (-1 == epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event)) {
+    if (EPERM != errno) {
+      int err = errno;
+
+      if (-1 != flags) {
+        fcntl(fd, F_SETFL, flags);
+      }
+
+      m_inputs.erase(id);
+      unlock();
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    pInput->pollable = false;
+    pInput->watched = false;
+  }
+
+  // the source thread may close and erase the input as soon as the mutex is
+  // unlocked
+  bool pollable = pInput->pollable;
+
+  unlock();
+
+  // a file input is picked up by the next round, which may be a blocking
+  // epoll_wait
+  if (!pollable) {
+    wakeup();
+  }
+
+  return id;
+}
+
+void Hal_IoSource::remove(Hal_IoSource::Id id) {
+  lock();
+  m_removals.push_back(id);
+  unlock();
+
+  wakeup();
+}
+
+void Hal_IoSource::waitForClosed() {
+  lock();
+
+  while (!m_inputs.empty()) {
+    int err = Hal_Proc::condWait(&m_closedCond, &m_mutex);
+    if (err) {
+      unlock();
+
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  unlock();
+}
+
+void Hal_IoSource::stop() {
+  if (isRunning()) {
+    // the source thread may be blocked in epoll_wait rather than condWait
+    requestStop();
+    wakeup();
+
+    Hal_Proc::wait();
+  }
+
+  lock();
+
+  for (auto &[id, input] : m_inputs) {
+    close(input->fd);
+  }
+
+  m_inputs.clear();
+
+  pthread_cond_broadcast(&m_closedCond);
+  unlock();
+}
+
+void Hal_IoSource::run() {
+  struct epoll_event events[kMaxEvents];
+
+  while (!Hal_Proc::stopRequested()) {
+    closeRemovedInputs();
+
+    // a file is read in every round, and an input with records left over is
+    // retried after kRetryMs, unless epoll has an input ready before
+    std::vector<Input *> inputs = getUnpolledInputs();
+    int timeout = -1;
+
+    for (Input *input : inputs) {
+      if (input->records.empty() && !input->ended) {
+        timeout = 0;
+
+        break;
+      }
+
+      timeout = kRetryMs;
+    }
+
+    int count = epoll_wait(m_epollFd, events, kMaxEvents, timeout);
+    if (-1 == count) {
+      if (EINTR == errno) {
+        continue;
+      }
+
+      throw std::runtime_error(strerror(errno));
+    }
+
+    // an input reported by epoll is set up by addInput under the mutex, so
+    // taking it orders that setup before the input is used here
+    lock();
+    unlock();
+
+    for (int i = 0; i < count; i++) {
+      if (nullptr == events[i].data.ptr) {
+        uint64_t value{};
+
+        while (read(m_wakeupFd, &value, sizeof(value)) > 0)
+          ;
+      } else {
+        readInput(*(Input *)events[i].data.ptr);
+      }
+    }
+
+    for (Input *input : inputs) {
+      readInput(*input);
+    }
+  }
+}
+
+void Hal_IoSource::readInput(Hal_IoSource::Input &input) {
+  // the records left over go first, and fd is not read until they are taken
+  if (!deliver(input)) {
+    return;
+  }
+
+  if (input.ended) {
+    closeInput(input, input.err);
+
+    return;
+  }
+
+  size_t total{};
+  bool ended{};
+  int err{};
+
+  while (total < kReadBudget) {
+    ssize_t size = read(input.fd, m_readBuffer.data(), m_readBuffer.size());
+
+    if (size > 0) {
+      input.bytes.append(m_readBuffer.data(), size);
+      total += size;
+    } else if (0 == size) {
+      ended = true;
+
+      break;
+    } else if (EINTR != errno) {
+      if (EAGAIN != errno && EWOULDBLOCK != errno) {
+        err = errno;
+        ended = true;
+      }
+
+      break;
+    }
+  }
+
+  try {
+    input.framer->frame(input.bytes, input.records);
+
+    if (ended) {
+      input.framer->finish(input.bytes, input.records);
+    }
+  } catch (const std::length_error &) {
+    err = EMSGSIZE;
+    ended = true;
+  }
+
+  input.ended = ended;
+  input.err = err;
+
+  if (deliver(input) && ended) {
+    closeInput(input, err);
+  }
+}
+
+bool Hal_IoSource::deliver(Hal_IoSource::Input &input) {
+  if (!input.records.empty()) {
+    size_t taken = input.fn(input.records);
+
+    // a task that takes every record may move the vector away
+    if (taken >= input.records.size()) {
+      input.records.clear();
+    } else {
+      input.records.erase(input.records.begin(),
+                          input.records.begin() + taken);
+    }
+  }
+
+  // epoll would report a pollable input that is not read again and again,
+  // so it is unwatched until its records are taken
+  if (input.pollable) {
+    watch(input, input.records.empty() && !input.ended);
+  }
+
+  return input.records.empty();
+}
+
+void Hal_IoSource::watch(Hal_IoSource::Input &input, bool watched) {
+  if (input.watched == watched) {
+    return;
+  }
+
+  struct epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = &input;
+
+  if (-1 == epoll_ctl(m_epollFd, watched ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                      input.fd, &event)) {
+    throw std::runtime_error(strerror(errno));
+  }
+
+  input.watched = watched;
+}
+
+void Hal_IoSource::closeInput(Hal_IoSource::Input &input, int err) {
+  int fd = input.fd;
+
+  if (input.watched) {
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL);
+  }
+
+  close(fd);
+
+  if (input.closeFn) {
+    input.closeFn(err);
+  }
+
+  lock();
+  m_inputs.erase(input.id);
+
+  err = pthread_cond_broadcast(&m_closedCond);
+  if (err) {
+    unlock();
+
+    throw std::runtime_error(strerror(err));
+  }
+
+  unlock();
+}
+
+void Hal_IoSource::closeRemovedInputs() {
+  std::vector<Input *> inputs{};
+
+  lock();
+
+  for (Hal_IoSource::Id id : m_removals) {
+    auto iter = m_inputs.find(id);
+    if (iter != m_inputs.end()) {
+      inputs.push_back(iter->second.get());
+    }
+  }
+
+  m_removals.clear();
+  unlock();
+
+  for (Input *input : inputs) {
+    // deliver what is already read, but not a partial record, the input is
+    // closed once it is taken
+    try {
+      input->framer->frame(input->bytes, input->records);
+    } catch (const std::length_error &) {
+      // a corrupt stream has nothing more to deliver
+    }
+
+    input->ended = true;
+    input->err = 0;
+
+    if (deliver(*input)) {
+      closeInput(*input, 0);
+    }
+  }
+}
+
+std::vector<Hal_IoSource::Input *> Hal_IoSource::getUnpolledInputs() {
+  std::vector<Input *> inputs{};
+
+  lock();
+
+  for (auto &[id, input] : m_inputs) {
+    if (!input->watched) {
+      inputs.push_back(input.get());
+    }
+  }
+
+  unlock();
+
+  return inputs;
+}
+
+void Hal_IoSource::wakeup() {
+  uint64_t value = 1;
+
+  if (-1 == write(m_wakeupFd, &value, sizeof(value)) && EAGAIN != errno) {
+    throw std::runtime_error(strerror(errno));
+  }
+}
+
+void Hal_IoSource::lock() {
+  int err = pthread_mutex_lock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+void Hal_IoSource::unlock() {
+  int err = pthread_mutex_unlock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
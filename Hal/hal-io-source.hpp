@@ -0,0 +1,260 @@
+/**
+ * This module implements Hal_IoSource, one thread that watches many file
+ * descriptors (pipes, sockets, timerfds via epoll, and regular files that
+ * are always readable) instead of a thread per input blocked in read().
+ *
+ * The bytes read from an input are split into records by its Hal_Framer
+ * (e.g. Hal_LineFramer or Hal_LengthPrefixFramer), and all the records of
+ * one read round are handed to the input's task at once, e.g. to write them
+ * to a Hal_Pipe with writeBatch, so a burst costs one buffer lock rather
+ * than one per record.
+ *
+ * The source owns the file descriptors added to it, it closes one at the
+ * end of input, on a read error, or when it is removed.
+ *
+ * The one source thread serves every input, so its tasks must not block,
+ * e.g. on a full pipe, as that stalls the other inputs too (and deadlocks
+ * if the pipe waits for another input of the source). An input whose
+ * target can be full is added with an OfferTask, which takes only the
+ * records that fit, the input is then not read again until its records
+ * left over are taken, while the other inputs carry on.
+ */
+
+#ifndef HAL_IO_SOURCE_HPP_HAVE_SEEN
+
+#define HAL_IO_SOURCE_HPP_HAVE_SEEN
+
+#include "hal-limit-buffer.hpp"
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+/**
+ * A framer moves the complete records at the front of bytes to records, and
+ * leaves a partial record in bytes for the next read. A framer that finds a
+ * corrupt stream throws std::length_error, and the input is then closed.
+ */
+class Hal_Framer {
+public:
+  virtual ~Hal_Framer() = default;
+
+  virtual void frame(std::string &bytes, std::vector<std::string> &records) = 0;
+
+  /**
+   * Called at the end of input with the bytes that are left, which are
+   * dropped by default.
+   */
+  virtual void finish(std::string &bytes, std::vector<std::string> &records);
+};
+
+/**
+ * Records end with '\n' (not part of the record), a last line without it is
+ * a record at the end of input.
+ */
+class Hal_LineFramer : public Hal_Framer {
+public:
+  void frame(std::string &bytes, std::vector<std::string> &records) override;
+  void finish(std::string &bytes, std::vector<std::string> &records) override;
+};
+
+/**
+ * Records are prefixed by their length in prefixSize (1 to 8) bytes in
+ * network byte order.
+ */
+class Hal_LengthPrefixFramer : public Hal_Framer {
+public:
+  static constexpr size_t kDefaultMaxRecordSize = 1 << 20;
+
+  Hal_LengthPrefixFramer(size_t prefixSize = 4,
+                         size_t maxRecordSize = kDefaultMaxRecordSize);
+
+  void frame(std::string &bytes, std::vector<std::string> &records) override;
+
+private:
+  const size_t m_prefixSize{};
+  const size_t m_maxRecordSize{};
+};
+
+/**
+ * Records of recordSize bytes, e.g. the 8 byte expiration count of a
+ * timerfd.
+ */
+class Hal_FixedSizeFramer : public Hal_Framer {
+public:
+  Hal_FixedSizeFramer(size_t recordSize);
+
+  void frame(std::string &bytes, std::vector<std::string> &records) override;
+
+private:
+  const size_t m_recordSize{};
+};
+
+class Hal_IoSource : public Hal_Proc {
+public:
+  using Task = Hal_Task<void(std::vector<std::string> &&)>;
+
+  // takes the records at the front of records that it can without blocking
+  // and returns how many, the source offers the rest again later.
+  using OfferTask = Hal_Task<size_t(std::vector<std::string> &)>;
+
+  // called with 0 at the end of input or when the input is removed, else
+  // with the errno of the failed read (EMSGSIZE for a corrupt stream).
+  using CloseTask = Hal_Task<void(int)>;
+
+  // an added input, 0 is never an input id
+  using Id = uint64_t;
+
+  Hal_IoSource(std::string_view name);
+  virtual ~Hal_IoSource() noexcept;
+
+  Hal_IoSource(const Hal_IoSource &halIoSource) = delete;
+  const Hal_IoSource &operator=(const Hal_IoSource &halIoSource) = delete;
+  Hal_IoSource(Hal_IoSource &&halIoSource) = delete;
+  Hal_IoSource &operator=(Hal_IoSource &&halIoSource) = delete;
+
+  /**
+   * Watches fd (made non-blocking if it can be polled), fn and closeFn run
+   * on the source thread, so they must not block (see OfferTask). Returns
+   * the id of the input for remove().
+   */
+  Hal_IoSource::Id add(int fd, std::unique_ptr<Hal_Framer> framer,
+                       Hal_IoSource::Task fn,
+                       Hal_IoSource::CloseTask closeFn = {});
+
+  /**
+   * As add, fn takes the records that it can without blocking, and fd is
+   * not read (nor closed at its end) until the rest is taken.
+   */
+  Hal_IoSource::Id add(int fd, std::unique_ptr<Hal_Framer> framer,
+                       Hal_IoSource::OfferTask fn,
+                       Hal_IoSource::CloseTask closeFn = {});
+
+  /**
+   * Writes the records of fd to pipe, without blocking the source thread if
+   * the pipe has writeFor (a bounded pipe, e.g. of Hal_LimitBuffer), else in
+   * batches with writeBatch (an unbounded pipe, e.g. of Hal_Buffer).
+   */
+  template <typename Pipe>
+  Hal_IoSource::Id addToPipe(int fd, std::unique_ptr<Hal_Framer> framer,
+                             Pipe &pipe,
+                             Hal_IoSource::CloseTask closeFn = {}) {
+    if constexpr (HasWriteFor<Pipe>::value) {
+      return add(
+          fd, std::move(framer),
+          [&pipe](std::vector<std::string> &records) {
+            size_t taken = 0;
+
+            for (; taken < records.size(); taken++) {
+              if (Hal_PushStatus::TimedOut ==
+                  pipe.writeFor(records[taken],
+                                std::chrono::nanoseconds::zero())) {
+                break;
+              }
+            }
+
+            return taken;
+          },
+          std::move(closeFn));
+    } else {
+      return add(
+          fd, std::move(framer),
+          [&pipe](std::vector<std::string> &&records) {
+            pipe.writeBatch(records.begin(), records.end());
+          },
+          std::move(closeFn));
+    }
+  }
+
+  /**
+   * Closes the input on the source thread once the records read so far are
+   * delivered. An input already closed is left alone, even if its fd number
+   * is reused by an input added since.
+   */
+  void remove(Hal_IoSource::Id id);
+
+  /**
+   * Waits until every input added so far is closed.
+   */
+  void waitForClosed();
+
+  /**
+   * Stops the source thread and closes the inputs left open.
+   */
+  void stop();
+
+private:
+  template <typename Pipe, typename = void>
+  struct HasWriteFor : std::false_type {};
+
+  template <typename Pipe>
+  struct HasWriteFor<Pipe, std::void_t<decltype(std::declval<Pipe &>().writeFor(
+                               std::declval<std::string &>(),
+                               std::chrono::nanoseconds{}))>>
+      : std::true_type {};
+
+  static constexpr int kMaxEvents = 64;
+  static constexpr size_t kReadSize = 64 * 1024;
+
+  // bytes read from one input before moving on to the next one
+  static constexpr size_t kReadBudget = 4 * kReadSize;
+
+  // how long the source thread sleeps before it offers the records left
+  // over again, if no input is ready meanwhile
+  static constexpr int kRetryMs = 1;
+
+  // all but id and fd are used by the source thread only, pollable and
+  // watched are set under m_mutex before fd is registered with epoll, and the
+  // source thread takes m_mutex after every epoll_wait, before it reads
+  // them.
+  struct Input {
+    Hal_IoSource::Id id{};
+    int fd{-1};
+    bool pollable{};
+    bool watched{}; // by epoll, a pollable input is not while records wait
+    bool ended{};   // the end of input is read, it is closed once delivered
+    int err{};
+    std::unique_ptr<Hal_Framer> framer{};
+    Hal_IoSource::OfferTask fn{};
+    Hal_IoSource::CloseTask closeFn{};
+    std::string bytes{};
+    std::vector<std::string> records{}; // framed but not taken yet
+  };
+
+  Hal_IoSource::Id addInput(std::unique_ptr<Input> input);
+  void run();
+  void readInput(Input &input);
+  bool deliver(Input &input);
+  void watch(Input &input, bool watched);
+  void closeInput(Input &input, int err);
+  void closeRemovedInputs();
+  std::vector<Input *> getUnpolledInputs();
+  void wakeup();
+  void lock();
+  void unlock();
+
+  int m_epollFd{-1};
+  int m_wakeupFd{-1};
+  std::vector<char> m_readBuffer{};
+
+  // guarded by m_mutex, the inputs are only erased by the source thread, so
+  // it uses them without the mutex.
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_closedCond{};
+  std::map<Hal_IoSource::Id, std::unique_ptr<Input>> m_inputs{};
+  std::vector<Hal_IoSource::Id> m_removals{};
+  Hal_IoSource::Id m_nextId{1};
+};
+
+#endif /* HAL_IO_SOURCE_HPP_HAVE_SEEN */
@@ -1,40 +1,98 @@
+/**
+ * This module implements a bounded multi-producer/multi-consumer buffer. All
+ * state (the queue, the size and the push/pop counters) is guarded by one
+ * mutex, so a bounded push or pop costs exactly one lock/unlock pair and at
+ * most one wakeup of the opposite side.
+ *
+ * The wait strategy selects how a consumer waits for an item and a producer
+ * for free capacity, see Hal_WaitStrategy.
+ *
+ * The overflow policy selects what a push does when the buffer is full, a
+ * producer of live data (e.g. sensor readings) may rather drop stale items
+ * than block and pass the latency spike upstream. pushFor and popFor wait
+ * at most a timeout, a pushFor that times out then applies the overflow
+ * policy (so Block returns TimedOut).
+ */
+
 #ifndef HAL_LIMITBUFFER_HPP_HAVE_SEEN
 
 #define HAL_LIMITBUFFER_HPP_HAVE_SEEN
 
-#include "hal-buffer.hpp"
+#include "hal-metrics.hpp"
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+#include "hal-wait-strategy.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <deque>
+#include <iterator>
 #include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <pthread.h>
+#include <time.h>
+
+enum class Hal_OverflowPolicy {
+  Block,          // waits for free capacity (the default)
+  DropNewest,     // drops the item being pushed
+  DropOldest,     // drops the oldest queued item to make room
+  CoalesceLatest, // replaces the queued item of the same key, else as
+                  // DropOldest
+  Reject,         // returns Rejected, the item is left with the caller
+};
 
-template <typename T> class Hal_LimitBuffer : private Hal_Buffer<T> {
+enum class Hal_PushStatus {
+  Pushed,
+  Dropped,        // the pushed item is dropped (DropNewest)
+  ReplacedOldest, // pushed, the oldest item is dropped
+  Coalesced,      // pushed in place of the queued item of the same key
+  Rejected,
+  TimedOut, // pushFor with the Block policy, the item is left with the caller
+};
+
+struct Hal_DropCounts {
+  uint64_t newest{};
+  uint64_t oldest{};
+  uint64_t coalesced{};
+  uint64_t rejected{};
+};
+
+template <typename T> class Hal_LimitBuffer {
 public:
-  Hal_LimitBuffer(size_t capacity = 1) : m_maxCapacity(capacity) {
+  using KeyFn = Hal_Task<size_t(const T &)>;
+
+  Hal_LimitBuffer(size_t capacity = 1, Hal_WaitStrategy waitStrategy = {})
+      : m_maxCapacity(capacity), m_waitStrategy{waitStrategy} {
     int err{};
 
+    assert(m_maxCapacity > 0);
+
     err = pthread_mutex_init(&m_mutex, NULL);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    err = pthread_cond_init(&m_pushCond, NULL);
-    if (err) {
-      throw std::runtime_error(strerror(err));
-    }
+    initTimedCond(&m_pushCond);
+    initTimedCond(&m_popCond);
 
-    err = pthread_cond_init(&m_popCond, NULL);
+    err = pthread_cond_init(&m_emptyCond, NULL);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
   }
 
   virtual ~Hal_LimitBuffer() {
+    pthread_cond_destroy(&m_emptyCond);
     pthread_cond_destroy(&m_pushCond);
     pthread_cond_destroy(&m_popCond);
     pthread_mutex_destroy(&m_mutex);
@@ -46,81 +104,608 @@ public:
   Hal_LimitBuffer(Hal_LimitBuffer<T> &&halLimitBuffer) = delete;
   Hal_LimitBuffer<T> &&operator=(Hal_LimitBuffer<T> &&halLimitBuffer) = delete;
 
-  void push(T &rItem) {
+  // moves from rItem if T's move constructor does not throw, copies it
+  // otherwise.
+  Hal_PushStatus push(T &rItem) {
+    return emplace(std::move_if_noexcept(rItem));
+  }
+
+  Hal_PushStatus push(T &&item) { return emplace(std::move(item)); }
+
+  /**
+   * Constructs the item in place from args, once there is free capacity or
+   * as the overflow policy says.
+   */
+  template <typename... Args> Hal_PushStatus emplace(Args &&...args) {
+    return pushItem(nullptr, std::forward<Args>(args)...);
+  }
+
+  Hal_PushStatus pushFor(T &rItem, std::chrono::nanoseconds timeout) {
+    struct timespec deadline = deadlineAfter(timeout);
+
+    return pushItem(&deadline, std::move_if_noexcept(rItem));
+  }
+
+  Hal_PushStatus pushFor(T &&item, std::chrono::nanoseconds timeout) {
+    struct timespec deadline = deadlineAfter(timeout);
+
+    return pushItem(&deadline, std::move(item));
+  }
+
+  /**
+   * With an overflow policy other than Block, the policy is applied item by
+   * item, and a rejected item is left in the input range.
+   */
+  template <typename InputIt> void pushBatch(InputIt first, InputIt last) {
     int err{};
+    uint64_t pushTime = m_metrics.stamp();
+
+    if (first == last) {
+      return;
+    }
+
+    if (Hal_OverflowPolicy::Block != getOverflowPolicy()) {
+      for (; first != last; ++first) {
+        push(*first);
+      }
+
+      return;
+    }
 
     err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
+    while (first != last) {
+      if (m_queue.size() >= m_maxCapacity) {
+        waitForCapacity(pushTime, nullptr);
+      }
+
+      long long pushCount = m_pushCount;
+
+      // move as many items as the free capacity allows, and wake up poppers
+      // once for the whole chunk.
+      for (; first != last && m_queue.size() < m_maxCapacity; ++first) {
+        m_queue.push_back(std::move_if_noexcept(*first));
+
+        if (m_metrics.isRecording()) {
+          m_pushTimes.push_back(pushTime);
+        }
+
+        ++m_pushCount;
+      }
 
-    while (m_size >= m_maxCapacity) {
-      err = pthread_cond_wait(&m_pushCond, &m_mutex);
+      m_size.store(m_queue.size(), std::memory_order_release);
+      m_metrics.pushed(m_pushCount - pushCount, m_queue.size());
+
+      err = pthread_cond_broadcast(&m_popCond);
       if (err) {
+        pthread_mutex_unlock(&m_mutex);
+
         throw std::runtime_error(strerror(err));
       }
-
-      pthread_testcancel();
     }
 
-    Hal_Buffer<T>::push(rItem);
+    unlockAndRun(m_readableTasks);
+  }
 
-    ++m_size;
+  size_t size() {
+    int err{};
+    size_t size{};
 
-    err = pthread_cond_signal(&m_popCond);
+    err = pthread_mutex_lock(&m_mutex);
     if (err) {
-      pthread_mutex_unlock(&m_mutex);
-
       throw std::runtime_error(strerror(err));
     }
 
+    size = m_queue.size();
+
     err = pthread_mutex_unlock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
+
+    return size;
   }
 
-  size_t size() {
+  T pop() { return *popItem(true, nullptr); }
+
+  std::optional<T> popNoWait() { return popItem(false, nullptr); }
+
+  /**
+   * Waits at most timeout for an item, no item if it times out.
+   */
+  std::optional<T> popFor(std::chrono::nanoseconds timeout) {
+    struct timespec deadline = deadlineAfter(timeout);
+
+    return popItem(true, &deadline);
+  }
+
+  std::vector<T> popBatch(size_t maxItems) {
     int err{};
-    size_t size{};
+    std::vector<T> items{};
+
+    assert(maxItems > 0);
+
+    Hal_WaitStrategy waitStrategy = getWaitStrategy();
+    auto ready = [this]() { return hasItem(); };
+
+    waitStrategy.spin(ready);
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    while (m_queue.empty()) {
+      err = waitStrategy.park(&m_popCond, &m_mutex, ready);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    }
+
+    size_t count = std::min(maxItems, m_queue.size());
+    items.reserve(count);
+    std::move(m_queue.begin(), m_queue.begin() + count,
+              std::back_inserter(items));
+    m_queue.erase(m_queue.begin(), m_queue.begin() + count);
+
+    if (m_metrics.isRecording()) {
+      uint64_t popTime = Hal_Metrics::now();
+      for (size_t i = 0; i < count; i++) {
+        m_metrics.dequeued(m_pushTimes[i], popTime);
+      }
+
+      m_pushTimes.erase(m_pushTimes.begin(), m_pushTimes.begin() + count);
+    }
+
+    m_popCount += count;
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.popped(count);
+
+    err = pthread_cond_broadcast(&m_pushCond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (m_queue.empty()) {
+      err = pthread_cond_broadcast(&m_emptyCond);
+      if (err) {
+        pthread_mutex_unlock(&m_mutex);
+
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    unlockAndRun(m_writableTasks);
+
+    return items;
+  }
+
+  long long waitForEmpty() {
+    int err{};
+    long long count{};
 
     err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
+    while (!m_queue.empty()) {
+      err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
 
-    size = m_size;
+      m_metrics.woken();
+    }
+
+    assert(m_popCount == m_pushCount);
+    count = m_popCount;
 
     err = pthread_mutex_unlock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    return size;
+    return count;
+  }
+
+  Hal_Metrics &metrics() { return m_metrics; }
+
+  Hal_WaitStrategy getWaitStrategy() const {
+    return m_waitStrategy.load(std::memory_order_relaxed);
   }
 
-  T pop() { return *pop(true); }
+  /**
+   * Takes effect at the next wait of a consumer or producer.
+   */
+  void setWaitStrategy(Hal_WaitStrategy waitStrategy) {
+    m_waitStrategy.store(waitStrategy, std::memory_order_relaxed);
+  }
 
-  std::optional<T> popNoWait() { return pop(false); }
+  /**
+   * Lets a consumer that has no thread to block (e.g. a coroutine) wait for
+   * an item: returns false if there is an item already, else keeps fn and
+   * returns true, and the next push calls fn once, on the pushing thread
+   * without the mutex, so fn should only hand off (e.g. post to an
+   * executor). Every kept fn is called, so a consumer that then finds the
+   * buffer empty asks again.
+   */
+  bool notifyWhenReadable(Hal_Task<void()> fn) {
+    return notifyUnless(m_readableTasks, std::move(fn),
+                        [this]() { return !m_queue.empty(); });
+  }
 
-  long long waitForEmpty() { return Hal_Buffer<T>::waitForEmpty(); }
+  /**
+   * As notifyWhenReadable, for a producer waiting for free capacity, fn is
+   * called by the next pop.
+   */
+  bool notifyWhenWritable(Hal_Task<void()> fn) {
+    return notifyUnless(m_writableTasks, std::move(fn), [this]() {
+      return m_queue.size() < m_maxCapacity;
+    });
+  }
+
+  Hal_OverflowPolicy getOverflowPolicy() const {
+    return m_overflowPolicy.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * keyFn maps an item to its key for CoalesceLatest (e.g. a sensor id), a
+   * coalescing push scans the queue for the key, so it is meant for small
+   * capacities.
+   */
+  void setOverflowPolicy(Hal_OverflowPolicy policy, KeyFn keyFn = {}) {
+    if (Hal_OverflowPolicy::CoalesceLatest == policy && !keyFn) {
+      throw std::invalid_argument("CoalesceLatest needs a key function");
+    }
+
+    if (Hal_OverflowPolicy::CoalesceLatest == policy &&
+        !std::is_move_assignable_v<T>) {
+      throw std::invalid_argument("CoalesceLatest needs a move assignable T");
+    }
+
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_keyFn = std::move(keyFn);
+    m_overflowPolicy.store(policy, std::memory_order_relaxed);
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  Hal_DropCounts drops() {
+    Hal_DropCounts drops{};
+
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    drops = m_drops;
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    return drops;
+  }
 
 private:
-  std::optional<T> pop(bool wait) {
+  // lock free polls of a spinning consumer or producer
+  bool hasItem() const { return m_size.load(std::memory_order_acquire) > 0; }
+
+  bool hasCapacity() const {
+    return m_size.load(std::memory_order_acquire) < m_maxCapacity;
+  }
+
+  static void initTimedCond(pthread_cond_t *cond) {
+    // the deadlines of pushFor and popFor are of the steady clock, which is
+    // CLOCK_MONOTONIC.
+    pthread_condattr_t condAttr{};
+
+    int err = pthread_condattr_init(&condAttr);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    if (err) {
+      pthread_condattr_destroy(&condAttr);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(cond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  static struct timespec deadlineAfter(std::chrono::nanoseconds timeout) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  (std::chrono::steady_clock::now() + timeout)
+                      .time_since_epoch())
+                  .count();
+    struct timespec ts{};
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+
+    return ts;
+  }
+
+  // waits with the mutex held on cond until ready(), or the deadline (if
+  // any) passes, and returns false if it times out.
+  template <typename Ready>
+  bool waitWithDeadline(pthread_cond_t *cond, const struct timespec *deadline,
+                        Ready ready) {
     int err{};
+    Hal_WaitStrategy waitStrategy = getWaitStrategy();
+
+    do {
+      if (nullptr == deadline) {
+        err = waitStrategy.park(cond, &m_mutex, ready);
+      } else {
+        err = Hal_Proc::condTimedWait(cond, &m_mutex, deadline);
+        if (ETIMEDOUT == err) {
+          return ready();
+        }
+      }
+
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    } while (!ready());
+
+    return true;
+  }
+
+  // waits with the mutex held for free capacity until the deadline (if
+  // any), the time the wait ends becomes the push time of the item, and
+  // returns false if it times out.
+  bool waitForCapacity(uint64_t &pushTime, const struct timespec *deadline) {
+    bool hasRoom =
+        waitWithDeadline(&m_pushCond, deadline,
+                         [this]() { return m_queue.size() < m_maxCapacity; });
+
+    if (m_metrics.isRecording()) {
+      uint64_t now = Hal_Metrics::now();
+      m_metrics.blocked(now - pushTime);
+      pushTime = now;
+    }
+
+    return hasRoom;
+  }
+
+  template <typename... Args>
+  Hal_PushStatus pushItem(const struct timespec *deadline, Args &&...args) {
+    int err{};
+    uint64_t pushTime = m_metrics.stamp();
+    Hal_OverflowPolicy policy = getOverflowPolicy();
+    auto ready = [this]() { return m_queue.size() < m_maxCapacity; };
+
+    if (nullptr == deadline && Hal_OverflowPolicy::Block == policy) {
+      getWaitStrategy().spin([this]() { return hasCapacity(); });
+    }
 
     err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
+    // re-read under the mutex, it may have changed while spinning
+    policy = getOverflowPolicy();
 
-    if (0 == m_size) {
+    if (!ready() &&
+        (nullptr != deadline || Hal_OverflowPolicy::Block == policy)) {
+      bool hasRoom = waitForCapacity(pushTime, deadline);
+
+      if (!hasRoom && Hal_OverflowPolicy::Block == policy) {
+        unlock();
+
+        return Hal_PushStatus::TimedOut;
+      }
+    }
+
+    if (ready()) {
+      return enqueue(pushTime, Hal_PushStatus::Pushed,
+                     std::forward<Args>(args)...);
+    }
+
+    switch (policy) {
+    case Hal_OverflowPolicy::Block:
+      break;
+
+    case Hal_OverflowPolicy::DropNewest:
+      ++m_drops.newest;
+      m_metrics.pushed(1, m_queue.size());
+      m_metrics.dropped(1);
+      unlock();
+
+      return Hal_PushStatus::Dropped;
+
+    case Hal_OverflowPolicy::Reject:
+      ++m_drops.rejected;
+      unlock();
+
+      return Hal_PushStatus::Rejected;
+
+    case Hal_OverflowPolicy::DropOldest:
+      dropOldest();
+
+      return enqueue(pushTime, Hal_PushStatus::ReplacedOldest,
+                     std::forward<Args>(args)...);
+
+    case Hal_OverflowPolicy::CoalesceLatest:
+      return coalesce(pushTime, std::forward<Args>(args)...);
+    }
+
+    // not reached, a Block push has room once it is done waiting
+    unlock();
+
+    throw std::logic_error("Hal_LimitBuffer push without room");
+  }
+
+  // with the mutex held, constructs the item at the back of the queue and
+  // releases the mutex.
+  template <typename... Args>
+  Hal_PushStatus enqueue(uint64_t pushTime, Hal_PushStatus status,
+                         Args &&...args) {
+    size_t size = m_queue.size();
+
+    try {
+      m_queue.emplace_back(std::forward<Args>(args)...);
+
+      if (m_metrics.isRecording()) {
+        m_pushTimes.push_back(pushTime);
+      }
+    } catch (...) {
+      if (m_queue.size() > size) {
+        m_queue.pop_back();
+      }
+
+      pthread_mutex_unlock(&m_mutex);
+
+      throw;
+    }
+
+    ++m_pushCount;
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.pushed(1, m_queue.size());
+
+    int err = pthread_cond_signal(&m_popCond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    unlockAndRun(m_readableTasks);
+
+    return status;
+  }
+
+  template <typename... Args>
+  Hal_PushStatus coalesce(uint64_t pushTime, Args &&...args) {
+    std::optional<T> item{};
+    size_t key{};
+
+    try {
+      item.emplace(std::forward<Args>(args)...);
+      key = m_keyFn(*item);
+    } catch (...) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw;
+    }
+
+    // the latest queued item of the key, it keeps its place in the queue
+    if constexpr (std::is_move_assignable_v<T>) {
+      for (size_t i = m_queue.size(); i-- > 0;) {
+        if (m_keyFn(m_queue[i]) == key) {
+          m_queue[i] = std::move(*item);
+
+          if (m_metrics.isRecording()) {
+            m_pushTimes[i] = pushTime;
+          }
+
+          ++m_drops.coalesced;
+          m_metrics.pushed(1, m_queue.size());
+          m_metrics.dropped(1);
+          unlock();
+
+          return Hal_PushStatus::Coalesced;
+        }
+      }
+    }
+
+    dropOldest();
+
+    return enqueue(pushTime, Hal_PushStatus::ReplacedOldest,
+                   std::move(*item));
+  }
+
+  // with the mutex held, the item is not popped, so it is not counted as
+  // pushed either.
+  void dropOldest() {
+    m_queue.pop_front();
+
+    if (m_metrics.isRecording()) {
+      m_pushTimes.pop_front();
+    }
+
+    --m_pushCount;
+    ++m_drops.oldest;
+    m_metrics.dropped(1);
+  }
+
+  void unlock() {
+    int err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  // with the mutex held, releases it and calls the tasks kept by
+  // notifyWhenReadable or notifyWhenWritable.
+  void unlockAndRun(std::vector<Hal_Task<void()>> &keptTasks) {
+    std::vector<Hal_Task<void()>> tasks{};
+    tasks.swap(keptTasks);
+
+    unlock();
+
+    for (auto &task : tasks) {
+      task();
+    }
+  }
+
+  template <typename Ready>
+  bool notifyUnless(std::vector<Hal_Task<void()>> &keptTasks,
+                    Hal_Task<void()> fn, Ready ready) {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    bool keep = !ready();
+    if (keep) {
+      keptTasks.push_back(std::move(fn));
+    }
+
+    unlock();
+
+    return keep;
+  }
+
+  std::optional<T> popItem(bool wait, const struct timespec *deadline) {
+    int err{};
+
+    if (wait && nullptr == deadline) {
+      getWaitStrategy().spin([this]() { return hasItem(); });
+    }
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    if (m_queue.empty()) {
       if (!wait) {
         err = pthread_mutex_unlock(&m_mutex);
         if (err) {
@@ -130,18 +715,25 @@ private:
         return {};
       }
 
-      do {
-        err = pthread_cond_wait(&m_popCond, &m_mutex);
-        if (err) {
-          throw std::runtime_error(strerror(err));
-        }
+      if (!waitWithDeadline(&m_popCond, deadline,
+                            [this]() { return !m_queue.empty(); })) {
+        unlock();
+
+        return {};
+      }
+    }
+
+    std::optional<T> val{std::move(m_queue.front())};
+    m_queue.pop_front();
 
-        pthread_testcancel();
-      } while (0 == m_size);
+    if (m_metrics.isRecording()) {
+      m_metrics.dequeued(m_pushTimes.front(), Hal_Metrics::now());
+      m_pushTimes.pop_front();
     }
 
-    T val = Hal_Buffer<T>::pop();
-    m_size--;
+    ++m_popCount;
+    m_size.store(m_queue.size(), std::memory_order_release);
+    m_metrics.popped(1);
 
     err = pthread_cond_signal(&m_pushCond);
     if (err) {
@@ -150,21 +742,39 @@ private:
       throw std::runtime_error(strerror(err));
     }
 
-    err = pthread_mutex_unlock(&m_mutex);
-    if (err) {
-      throw std::runtime_error(strerror(err));
+    if (m_queue.empty()) {
+      err = pthread_cond_broadcast(&m_emptyCond);
+      if (err) {
+        pthread_mutex_unlock(&m_mutex);
+
+        throw std::runtime_error(strerror(err));
+      }
     }
 
+    unlockAndRun(m_writableTasks);
+
     return val; // val is local variable, hence rvalue and hence move semantic
                 // by default for efficient copy.
   }
 
 private:
   size_t m_maxCapacity{1};
-  size_t m_size{0};
+  std::deque<T> m_queue{};
+  std::deque<uint64_t> m_pushTimes{}; // empty unless metrics are recorded
   pthread_mutex_t m_mutex{};
   pthread_cond_t m_popCond{};
   pthread_cond_t m_pushCond{};
+  pthread_cond_t m_emptyCond{};
+  long long m_pushCount{};
+  long long m_popCount{};
+  Hal_Metrics m_metrics{};
+  std::atomic<size_t> m_size{};
+  std::atomic<Hal_WaitStrategy> m_waitStrategy{};
+  std::atomic<Hal_OverflowPolicy> m_overflowPolicy{};
+  KeyFn m_keyFn{};
+  Hal_DropCounts m_drops{};
+  std::vector<Hal_Task<void()>> m_readableTasks{};
+  std::vector<Hal_Task<void()>> m_writableTasks{};
 };
 
 #endif /* HAL_LIMITBUFFER_HPP_HAVE_SEEN */
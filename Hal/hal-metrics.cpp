@@ -0,0 +1,152 @@
+#include "hal-metrics.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <pthread.h>
+
+std::atomic<bool> Hal_Metrics::s_enabled{};
+
+void Hal_Metrics::enable() { s_enabled.store(true, std::memory_order_relaxed); }
+
+void Hal_Metrics::disable() {
+  s_enabled.store(false, std::memory_order_relaxed);
+}
+
+double Hal_HistogramSnapshot::mean() const {
+  return 0 == count ? 0.0 : (double)sum / count;
+}
+
+uint64_t Hal_HistogramSnapshot::percentile(double p) const {
+  uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+  uint64_t seen{};
+
+  if (0 == count) {
+    return 0;
+  }
+
+  rank = std::max<uint64_t>(rank, 1);
+
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets[i];
+
+    if (seen >= rank) {
+      uint64_t upper = 0 == i ? 0 : (1ull << i) - 1;
+
+      return std::min(upper, max);
+    }
+  }
+
+  return max;
+}
+
+Hal_HistogramSnapshot Hal_Histogram::snapshot() const {
+  Hal_HistogramSnapshot histogram{};
+
+  for (int i = 0; i < Hal_HistogramSnapshot::kBuckets; i++) {
+    histogram.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+  }
+
+  histogram.count = m_count.load(std::memory_order_relaxed);
+  histogram.sum = m_sum.load(std::memory_order_relaxed);
+  histogram.max = m_max.load(std::memory_order_relaxed);
+
+  return histogram;
+}
+
+Hal_MetricsSnapshot Hal_Metrics::snapshot() const {
+  Hal_MetricsSnapshot metrics{};
+
+  // read the pop count first, so the depth never goes negative with
+  // concurrent pushes and pops (an item is counted as pushed before it is
+  // dropped).
+  metrics.popCount = m_popCount.load(std::memory_order_acquire);
+  metrics.pushCount = m_pushCount.load(std::memory_order_acquire);
+  metrics.dropCount = m_dropCount.load(std::memory_order_relaxed);
+
+  uint64_t gone = metrics.popCount + metrics.dropCount;
+  metrics.depth = metrics.pushCount - std::min(gone, metrics.pushCount);
+  metrics.depthHighWater = m_depthHighWater.load(std::memory_order_relaxed);
+  metrics.wakeups = m_wakeups.load(std::memory_order_relaxed);
+  metrics.latency = m_latency.snapshot();
+  metrics.processing = m_processing.snapshot();
+  metrics.blockedPush = m_blockedPush.snapshot();
+
+  return metrics;
+}
+
+Hal_MetricsRegistry::Hal_MetricsRegistry() {
+  int err = pthread_mutex_init(&m_mutex, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+Hal_MetricsRegistry::~Hal_MetricsRegistry() noexcept {
+  pthread_mutex_destroy(&m_mutex);
+}
+
+void Hal_MetricsRegistry::add(std::string_view name,
+                              const Hal_Metrics *metrics) {
+  int err = pthread_mutex_lock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  m_metrics.emplace(std::string(name), metrics);
+
+  err = pthread_mutex_unlock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+void Hal_MetricsRegistry::remove(const Hal_Metrics *metrics) {
+  int err = pthread_mutex_lock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  for (auto iter = m_metrics.begin(); iter != m_metrics.end();) {
+    if (metrics == iter->second) {
+      iter = m_metrics.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  err = pthread_mutex_unlock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+std::vector<std::pair<std::string, Hal_MetricsSnapshot>>
+Hal_MetricsRegistry::snapshot() {
+  std::vector<std::pair<std::string, Hal_MetricsSnapshot>> snapshots{};
+
+  int err = pthread_mutex_lock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  for (auto &[name, metrics] : m_metrics) {
+    snapshots.emplace_back(name, metrics->snapshot());
+  }
+
+  err = pthread_mutex_unlock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  return snapshots;
+}
+
+Hal_MetricsRegistry &Hal_MetricsRegistry::getDefault() {
+  static Hal_MetricsRegistry registry{};
+
+  return registry;
+}
@@ -0,0 +1,224 @@
+/**
+ * This module implements the metrics of the Hal buffers and pipes, counters
+ * and log2 bucketed histograms that are updated with relaxed atomics on the
+ * push and pop paths, and read at any time as a plain snapshot.
+ *
+ * Every Hal_Pipe (and so Hal_TeePipe) registers the metrics of its buffer in
+ * the default Hal_MetricsRegistry under its Hal_Proc name, so that a single
+ * snapshot of the registry shows which stage of a pipeline is the
+ * bottleneck: the stage with the growing queue depth, enqueue to dequeue
+ * latency and processing time, and whose writers spend time blocked.
+ *
+ * Recording is off by default, as reading the clock twice per item costs
+ * more than the push and pop themselves. Hal_Metrics::enable() turns it on
+ * for the buffers and pipes created afterwards, a buffer created while it
+ * is off never reads the clock, keeps no push times and its snapshot stays
+ * zero.
+ */
+
+#ifndef HAL_METRICS_HPP_HAVE_SEEN
+
+#define HAL_METRICS_HPP_HAVE_SEEN
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+struct Hal_HistogramSnapshot {
+  static constexpr int kBuckets = 64;
+
+  uint64_t count{};
+  uint64_t sum{};
+  uint64_t max{};
+
+  // bucket i counts the values v with 2^(i-1) <= v < 2^i (0 in bucket 0,
+  // and the last bucket has no upper bound)
+  std::array<uint64_t, kBuckets> buckets{};
+
+  double mean() const;
+
+  /**
+   * The upper bound of the bucket that holds the p-th percentile (0 < p <=
+   * 100) of the values, capped by max, 0 if there is no value.
+   */
+  uint64_t percentile(double p) const;
+};
+
+class Hal_Histogram {
+public:
+  void record(uint64_t value) {
+    int bucket = 0 == value ? 0 : std::min(64 - __builtin_clzll(value), 63);
+
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (value > max &&
+           !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+      ;
+  }
+
+  Hal_HistogramSnapshot snapshot() const;
+
+private:
+  std::array<std::atomic<uint64_t>, Hal_HistogramSnapshot::kBuckets>
+      m_buckets{};
+  std::atomic<uint64_t> m_count{};
+  std::atomic<uint64_t> m_sum{};
+  std::atomic<uint64_t> m_max{};
+};
+
+struct Hal_MetricsSnapshot {
+  uint64_t pushCount{};
+  uint64_t popCount{};
+  uint64_t dropCount{}; // pushed items dropped by an overflow policy
+  uint64_t depth{};
+  uint64_t depthHighWater{};
+  uint64_t wakeups{};                 // condvar wakeups of waiting threads
+  Hal_HistogramSnapshot latency{};    // enqueue to dequeue, ns
+  Hal_HistogramSnapshot processing{}; // pipe task run time per call, ns
+  Hal_HistogramSnapshot blockedPush{}; // push waiting for capacity, ns
+};
+
+/**
+ * The writer side (push and drop counts, depth high-water mark and blocked
+ * push time) and the reader side of the metrics live on their own cache
+ * lines, so that a single producer and a single consumer do not share one.
+ */
+class Hal_Metrics {
+  static constexpr size_t kCacheLineSize = 64;
+
+public:
+  Hal_Metrics() : m_recording{isEnabled()} {}
+
+  static void enable();
+
+  static void disable();
+
+  static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  /**
+   * True if these metrics were created with recording enabled, the owner
+   * then keeps the push times of its items for dequeued().
+   */
+  bool isRecording() const { return m_recording; }
+
+  /**
+   * now() if recording, 0 (without reading the clock) otherwise.
+   */
+  uint64_t stamp() const { return m_recording ? now() : 0; }
+
+  void pushed(uint64_t count, uint64_t depth) {
+    if (!m_recording) {
+      return;
+    }
+
+    m_pushCount.fetch_add(count, std::memory_order_relaxed);
+
+    uint64_t highWater = m_depthHighWater.load(std::memory_order_relaxed);
+    while (depth > highWater &&
+           !m_depthHighWater.compare_exchange_weak(highWater, depth,
+                                                   std::memory_order_relaxed))
+      ;
+  }
+
+  void blocked(uint64_t ns) {
+    if (m_recording) {
+      m_blockedPush.record(ns);
+    }
+  }
+
+  void dropped(uint64_t count) {
+    if (m_recording) {
+      m_dropCount.fetch_add(count, std::memory_order_relaxed);
+    }
+  }
+
+  void popped(uint64_t count) {
+    if (m_recording) {
+      m_popCount.fetch_add(count, std::memory_order_relaxed);
+    }
+  }
+
+  void dequeued(uint64_t enqueueTime, uint64_t dequeueTime) {
+    if (m_recording) {
+      m_latency.record(dequeueTime - enqueueTime);
+    }
+  }
+
+  void woken() {
+    if (m_recording) {
+      m_wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void processed(uint64_t ns) {
+    if (m_recording) {
+      m_processing.record(ns);
+    }
+  }
+
+  Hal_MetricsSnapshot snapshot() const;
+
+private:
+  static std::atomic<bool> s_enabled;
+
+  const bool m_recording{};
+
+  alignas(kCacheLineSize) std::atomic<uint64_t> m_pushCount{};
+  std::atomic<uint64_t> m_depthHighWater{};
+  std::atomic<uint64_t> m_dropCount{};
+  Hal_Histogram m_blockedPush{};
+
+  alignas(kCacheLineSize) std::atomic<uint64_t> m_popCount{};
+  std::atomic<uint64_t> m_wakeups{};
+  Hal_Histogram m_latency{};
+  Hal_Histogram m_processing{};
+};
+
+/**
+ * Hal_MetricsRegistry keeps the metrics of the live Hal objects by name, a
+ * name can be registered more than once (e.g. two pipes of the same name).
+ */
+class Hal_MetricsRegistry {
+public:
+  Hal_MetricsRegistry();
+  virtual ~Hal_MetricsRegistry() noexcept;
+
+  Hal_MetricsRegistry(const Hal_MetricsRegistry &halMetricsRegistry) = delete;
+  const Hal_MetricsRegistry &
+  operator=(const Hal_MetricsRegistry &halMetricsRegistry) = delete;
+  Hal_MetricsRegistry(Hal_MetricsRegistry &&halMetricsRegistry) = delete;
+  Hal_MetricsRegistry &
+  operator=(Hal_MetricsRegistry &&halMetricsRegistry) = delete;
+
+  void add(std::string_view name, const Hal_Metrics *metrics);
+  void remove(const Hal_Metrics *metrics);
+
+  std::vector<std::pair<std::string, Hal_MetricsSnapshot>> snapshot();
+
+  static Hal_MetricsRegistry &getDefault();
+
+private:
+  pthread_mutex_t m_mutex{};
+  std::multimap<std::string, const Hal_Metrics *> m_metrics{};
+};
+
+#endif /* HAL_METRICS_HPP_HAVE_SEEN */
@@ -3,17 +3,56 @@
 #define HAL_PIPE_HPP_HAVE_SEEN
 
 #include "hal-buffer.hpp"
+#include "hal-metrics.hpp"
 #include "hal-proc.hpp"
+#include "hal-ring-buffer.hpp"
+#include "hal-task.hpp"
+#include "hal-trace.hpp"
 
+#include <atomic>
+#include <cassert>
+#include <chrono>
 #include <cstring>
-#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include <pthread.h>
 
-template <typename T> class Hal_Pipe : public Hal_Buffer<T>, public Hal_Proc {
-  using Task = std::function<void(T &&)>;
+/**
+ * The Buffer template parameter selects the queue between writers and the
+ * pipe thread at compile time, e.g. Hal_RingBuffer<T> for a pipe that has
+ * exactly one writer thread.
+ *
+ * A pipe can run its task on more than one consumer thread (workers), the
+ * task is then called concurrently and must be thread safe, and the Buffer
+ * must support multiple consumers, a pipe over a buffer that declares
+ * kSingleConsumer (Hal_RingBuffer, Hal_ShardedBuffer) throws
+ * std::invalid_argument for more than one worker.
+ *
+ * The metrics of the buffer, plus the run time of the task, are registered
+ * in the default Hal_MetricsRegistry under the pipe name, and the writes,
+ * reads and task runs are recorded by Hal_Trace when it is enabled.
+ */
+template <typename T, typename Buffer = Hal_Buffer<T>>
+class Hal_Pipe : public Buffer, public Hal_Proc {
+  using Task = Hal_Task<void(T &&)>;
+  using BatchTask = Hal_Task<void(std::vector<T> &&)>;
 
 public:
-  Hal_Pipe(std::string_view name, Hal_Pipe::Task fn = {}) : Hal_Proc{name} {
+  /**
+   * The pipe threads (workers of them if fn is given) start at once, with
+   * options applied before they run, e.g. to pin a latency critical stage.
+   */
+  Hal_Pipe(std::string_view name, Hal_Pipe::Task fn = {}, size_t workers = 1,
+           Hal_ProcOptions options = {})
+      : Hal_Proc{name}, m_traceName{Hal_Trace::intern(name)} {
     int err = pthread_mutex_init(&m_mutex, NULL);
     if (err) {
       throw std::runtime_error(strerror(err));
@@ -25,17 +64,43 @@ public:
     }
 
     if (fn) {
-      exec([this, fn]() {
-        while (true) {
-          readAndProcess(fn);
+      m_task = std::move(fn);
+
+      runWorkers(name, workers, std::move(options), [this]() {
+        while (!Hal_Proc::stopRequested()) {
+          readAndProcess(m_task);
+        }
+      });
+    }
+
+    // after runWorkers, which may throw before the destructor can remove it
+    Hal_MetricsRegistry::getDefault().add(name, &this->metrics());
+  }
+
+  /**
+   * The pipe thread hands fn up to maxBatchSize items drained from the
+   * buffer at once, rather than calling a Task per item.
+   */
+  Hal_Pipe(std::string_view name, Hal_Pipe::BatchTask fn, size_t maxBatchSize,
+           size_t workers = 1, Hal_ProcOptions options = {})
+      : Hal_Pipe{name} {
+    if (fn) {
+      m_batchTask = std::move(fn);
+
+      runWorkers(name, workers, std::move(options), [this, maxBatchSize]() {
+        while (!Hal_Proc::stopRequested()) {
+          readAndProcessBatch(m_batchTask, maxBatchSize);
         }
       });
     }
   }
 
   virtual ~Hal_Pipe() noexcept try {
+    Hal_MetricsRegistry::getDefault().remove(&this->metrics());
+
     // stopExec is not noexcept, so we need to resolve it in destructor
-    Hal_Proc::stopExec();
+    stopWorkers();
+
     pthread_cond_destroy(&m_emptyCond);
     pthread_mutex_destroy(&m_mutex);
   } catch (...) {
@@ -43,86 +108,306 @@ public:
     return;
   }
 
-  Hal_Pipe(const Hal_Pipe<T> &halPipe) = delete;
-  const Hal_Pipe<T> &operator=(const Hal_Pipe<T> &halPipe) = delete;
-  Hal_Pipe(Hal_Pipe<T> &&halPipe) = delete;
-  Hal_Pipe<T> &operator=(Hal_Pipe<T> &&halPipe) = delete;
+  Hal_Pipe(const Hal_Pipe &halPipe) = delete;
+  const Hal_Pipe &operator=(const Hal_Pipe &halPipe) = delete;
+  Hal_Pipe(Hal_Pipe &&halPipe) = delete;
+  Hal_Pipe &operator=(Hal_Pipe &&halPipe) = delete;
 
+  /**
+   * Moves the next item out of the buffer, T does not have to be default
+   * constructible or copyable.
+   */
   T read() {
-    T data{};
+    std::optional<T> data{};
+
+    readAndProcess([&data](T &&item) { data.emplace(std::move(item)); });
+
+    return std::move(*data);
+  }
+
+  /**
+   * The next item if there is one, without waiting, for a reader that has
+   * no thread to block (see notifyWhenReadable of the buffer).
+   */
+  std::optional<T> readNoWait() {
+    std::optional<T> item = this->popNoWait();
+
+    if (item) {
+      Hal_Trace::record(m_traceName, Hal_TraceEvent::Pop);
+      completed(1);
+    }
+
+    return item;
+  }
+
+  void readAndProcess(const Hal_Pipe::Task &fn) {
+    T item = this->pop();
+
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Pop);
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessBegin);
+
+    uint64_t startTime = this->metrics().stamp();
+    fn(std::move(item));
+
+    if (this->metrics().isRecording()) {
+      this->metrics().processed(Hal_Metrics::now() - startTime);
+    }
 
-    readAndProcess([&data](T &&item) { data = item; });
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessEnd);
 
-    return std::move(data);
+    completed(1);
   }
 
-  void readAndProcess(Hal_Pipe::Task fn) {
-    T &&item = this->pop();
+  void readAndProcessBatch(const Hal_Pipe::BatchTask &fn, size_t maxItems) {
+    std::vector<T> items = this->popBatch(maxItems);
+    long long count = items.size();
+
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Pop, count);
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessBegin, count);
+
+    uint64_t startTime = this->metrics().stamp();
+    fn(std::move(items));
 
-    int errInLoop = pthread_mutex_lock(&m_mutex);
-    if (errInLoop) {
-      throw std::runtime_error(strerror(errInLoop));
+    if (this->metrics().isRecording()) {
+      this->metrics().processed(Hal_Metrics::now() - startTime);
     }
 
-    pthread_testcancel();
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::ProcessEnd, count);
+
+    completed(count);
+  }
+
+  // moves from rItem if T's move constructor does not throw, copies it
+  // otherwise. Returns what the buffer push returns, e.g. the
+  // Hal_PushStatus of a Hal_LimitBuffer.
+  decltype(auto) write(T &rItem) {
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Push);
+
+    return Buffer::push(rItem);
+  }
+
+  decltype(auto) write(T &&item) {
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Push);
+
+    return Buffer::push(std::move(item));
+  }
+
+  /**
+   * Waits at most timeout for room in a bounded buffer (one with pushFor,
+   * e.g. Hal_LimitBuffer), e.g. to write from a thread that must not block.
+   */
+  template <typename B = Buffer>
+  auto writeFor(T &rItem, std::chrono::nanoseconds timeout)
+      -> decltype(std::declval<B &>().pushFor(rItem, timeout)) {
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Push);
 
-    fn(std::move_if_noexcept(item));
+    return Buffer::pushFor(rItem, timeout);
+  }
+
+  template <typename... Args> decltype(auto) emplace(Args &&...args) {
+    Hal_Trace::record(m_traceName, Hal_TraceEvent::Push);
 
-    ++m_count;
+    return Buffer::emplace(std::forward<Args>(args)...);
+  }
 
-    errInLoop = pthread_cond_signal(&m_emptyCond);
-    if (errInLoop) {
-      pthread_mutex_unlock(&m_mutex);
+  template <typename InputIt> void writeBatch(InputIt first, InputIt last) {
+    using Category = typename std::iterator_traits<InputIt>::iterator_category;
 
-      throw std::runtime_error(strerror(errInLoop));
+    // a single pass iterator can not be counted ahead of the push
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, Category>) {
+      if (Hal_Trace::isEnabled()) {
+        Hal_Trace::record(m_traceName, Hal_TraceEvent::Push,
+                          std::distance(first, last));
+      }
     }
 
-    pthread_testcancel();
+    Buffer::pushBatch(first, last);
+  }
 
-    errInLoop = pthread_mutex_unlock(&m_mutex);
-    if (errInLoop) {
-      throw std::runtime_error(strerror(errInLoop));
+  /**
+   * Applies options to the pipe thread and to every extra worker thread.
+   */
+  void setOptions(Hal_ProcOptions options) override {
+    for (auto &worker : m_workers) {
+      worker->setOptions(options);
     }
+
+    Hal_Proc::setOptions(std::move(options));
   }
 
-  void write(T &rItem) { Hal_Buffer<T>::push(rItem); }
+  enum class StopMode {
+    Drain,     // process every item written so far, then stop
+    Immediate, // stop after the item being processed, drop the rest
+  };
+
+  /**
+   * Stops the pipe thread and its workers, each finishes the call of the
+   * task that it is in the middle of (the task can poll
+   * Hal_Proc::stopRequested() to return early) and unwinds normally.
+   */
+  void stop(StopMode mode = StopMode::Drain) {
+    if (StopMode::Drain == mode) {
+      waitForEmpty();
+    }
+
+    for (auto &worker : m_workers) {
+      worker->requestStop();
+    }
+
+    requestStop();
+
+    for (auto &worker : m_workers) {
+      if (worker->isRunning()) {
+        worker->wait();
+      }
+    }
+
+    if (isRunning()) {
+      Hal_Proc::wait();
+    }
+  }
 
   void waitForEmpty() {
     long long inboundCount{};
 
-    inboundCount = Hal_Buffer<T>::waitForEmpty();
+    inboundCount = Buffer::waitForEmpty();
 
     int err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
+    // announce ourself before checking the count, completed() bumps the count
+    // before checking for waiters, so one of us always sees the other.
+    m_emptyWaiters.fetch_add(1, std::memory_order_seq_cst);
+
+    while (m_count.load(std::memory_order_seq_cst) < inboundCount) {
+      try {
+        err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
+      } catch (const Hal_StopException &) {
+        m_emptyWaiters.fetch_sub(1, std::memory_order_relaxed);
+
+        throw;
+      }
 
-    while (m_count < inboundCount) {
-      err = pthread_cond_wait(&m_emptyCond, &m_mutex);
       if (err) {
+        m_emptyWaiters.fetch_sub(1, std::memory_order_relaxed);
+
         throw std::runtime_error(strerror(err));
       }
-
-      pthread_testcancel();
     }
 
+    m_emptyWaiters.fetch_sub(1, std::memory_order_relaxed);
+
     err = pthread_mutex_unlock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
   }
 
+protected:
+  // the pipe name as a Hal_Trace name
+  const uint32_t m_traceName{};
+
 private:
-  using Hal_Buffer<T>::pop;
-  using Hal_Buffer<T>::push;
+  using Buffer::pop;
+  using Buffer::popBatch;
+  using Buffer::push;
+  using Buffer::pushBatch;
+
+  // a buffer that allows only one thread to pop declares kSingleConsumer
+  template <typename B, typename = void>
+  struct IsSingleConsumer : std::false_type {};
+
+  template <typename B>
+  struct IsSingleConsumer<B, std::void_t<decltype(B::kSingleConsumer)>>
+      : std::bool_constant<B::kSingleConsumer> {};
+
+  template <typename Loop>
+  void runWorkers(std::string_view name, size_t workers,
+                  Hal_ProcOptions options, Loop loop) {
+    assert(workers > 0);
+
+    if (workers > 1 && IsSingleConsumer<Buffer>::value) {
+      throw std::invalid_argument("Hal_Pipe " + std::string(name) +
+                                  " buffer allows a single worker");
+    }
+
+    // not yet running, so the options are taken when the thread is created
+    Hal_Proc::setOptions(options);
+
+    // a thread is not created e.g. for a real-time policy without the
+    // privilege (EPERM), and the pipe is then not usable
+    bool started = exec(loop);
+
+    for (size_t i = 1; started && i < workers; ++i) {
+      auto worker = std::make_unique<Hal_Proc>(std::string(name) + "-" +
+                                                   std::to_string(i),
+                                               loop, options);
+      started = worker->exec();
+      if (started) {
+        m_workers.push_back(std::move(worker));
+      }
+    }
+
+    if (!started) {
+      stopWorkers();
+
+      throw std::runtime_error("Hal_Pipe " + std::string(name) +
+                               " can not start its workers");
+    }
+  }
+
+  void stopWorkers() {
+    // the extra workers share the buffer with the pipe thread, so stop them
+    // before the buffer goes away, all asked at once so they stop together.
+    for (auto &worker : m_workers) {
+      worker->requestStop();
+    }
+
+    m_workers.clear();
+
+    if (isRunning()) {
+      Hal_Proc::stopExec();
+    }
+  }
+
+  void completed(long long count) {
+    m_count.fetch_add(count, std::memory_order_seq_cst);
+
+    if (m_emptyWaiters.load(std::memory_order_seq_cst) > 0) {
+      int err = pthread_mutex_lock(&m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      err = pthread_cond_broadcast(&m_emptyCond);
+      if (err) {
+        pthread_mutex_unlock(&m_mutex);
+
+        throw std::runtime_error(strerror(err));
+      }
+
+      err = pthread_mutex_unlock(&m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+  }
+
+  Hal_Pipe::Task m_task{};
+
+  Hal_Pipe::BatchTask m_batchTask{};
 
   pthread_mutex_t m_mutex{};
 
   pthread_cond_t m_emptyCond{};
 
-  long long m_count{};
+  std::atomic<long long> m_count{};
+
+  std::atomic<int> m_emptyWaiters{};
+
+  std::vector<std::unique_ptr<Hal_Proc>> m_workers{};
 };
 
 #endif /* HAL_PIPE_HPP_HAVE_SEEN */
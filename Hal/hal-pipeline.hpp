@@ -0,0 +1,398 @@
+/**
+ * This module implements Hal_Pipeline, a builder of a graph of stages that
+ * all process items of type T, e.g. staging -> filter -> cal -> out. The
+ * stages and the edges between them are declared first, and build() then
+ * decides where a queue (and a thread) pays off:
+ *
+ * - a stage is fused onto its only upstream stage, so it runs as a plain
+ *   function call on the upstream thread without any handoff, if it is cheap
+ *   (Fusion::Auto and its cost below the fuseBelow threshold of the
+ *   pipeline) or if it is asked to (Fusion::Always).
+ * - an entry stage (no upstream), a stage with more than one upstream, a
+ *   stage with more than one worker or an expensive stage gets its own
+ *   Hal_Pipe, a lock free Hal_RingBuffer one if it has a single writer
+ *   thread and a single worker.
+ *
+ * Each Hal_Pipe is named after the stages fused into it, e.g.
+ * "filter+cal+out", so the metrics registry shows the chosen plan, and
+ * when Hal_Trace is enabled every stage run is also recorded under the
+ * stage name, so the stages fused into one pipe can be told apart.
+ *
+ * A stage function gets the item and an Emit, it passes items downstream
+ * by calling the Emit (none, one or many times), an item emitted by a stage
+ * with more than one downstream stage is copied to all but the last.
+ */
+
+#ifndef HAL_PIPELINE_HPP_HAVE_SEEN
+
+#define HAL_PIPELINE_HPP_HAVE_SEEN
+
+#include "hal-buffer.hpp"
+#include "hal-pipe.hpp"
+#include "hal-proc.hpp"
+#include "hal-ring-buffer.hpp"
+#include "hal-task.hpp"
+#include "hal-trace.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+enum class Hal_PipelineFusion {
+  Auto,   // fused if its cost is below the fuseBelow threshold
+  Always, // fused whenever the graph allows it
+  Never,  // always has its own queue and thread(s)
+};
+
+struct Hal_PipelineStageOptions {
+  Hal_PipelineFusion fusion{Hal_PipelineFusion::Auto};
+
+  // expected run time per item, e.g. the processing mean of the stage in a
+  // metrics snapshot of an earlier run, 0 if unknown (cheap).
+  std::chrono::nanoseconds cost{};
+
+  // threads running the stage, the stage function must then be thread safe.
+  size_t workers{1};
+
+  // how the threads of the stage's pipe run, e.g. pinned to some CPUs, a
+  // fused stage runs on the threads of the stage it is fused onto.
+  Hal_ProcOptions proc{};
+};
+
+template <typename T> class Hal_Pipeline {
+public:
+  /**
+   * Passes items from a stage to its downstream stages.
+   */
+  class Emit {
+  public:
+    Emit(Hal_Pipeline *pipeline, size_t stage)
+        : m_pipeline{pipeline}, m_stage{stage} {}
+
+    void operator()(T &&item) { m_pipeline->emit(m_stage, std::move(item)); }
+
+    void operator()(const T &item) { m_pipeline->emit(m_stage, T{item}); }
+
+  private:
+    Hal_Pipeline *m_pipeline{};
+    size_t m_stage{};
+  };
+
+  using Task = Hal_Task<void(T &&, Emit &)>;
+
+  Hal_Pipeline(std::string_view name,
+               std::chrono::nanoseconds fuseBelow = std::chrono::microseconds(
+                   kDefaultFuseBelowUs))
+      : m_name{name}, m_fuseBelow{fuseBelow} {}
+
+  virtual ~Hal_Pipeline() noexcept try {
+    // stop the queues from upstream to downstream, so that no stage thread
+    // writes to a queue that is already gone.
+    for (size_t index : m_order) {
+      m_stages[index]->queue.reset();
+    }
+  } catch (...) {
+    // explicit return to resolve exception as destructor must be noexcept
+    return;
+  }
+
+  Hal_Pipeline(const Hal_Pipeline &halPipeline) = delete;
+  const Hal_Pipeline &operator=(const Hal_Pipeline &halPipeline) = delete;
+  Hal_Pipeline(Hal_Pipeline &&halPipeline) = delete;
+  Hal_Pipeline &operator=(Hal_Pipeline &&halPipeline) = delete;
+
+  /**
+   * Declares a stage, and returns its id for connect() and write().
+   */
+  size_t addStage(std::string_view name, Task fn,
+                  Hal_PipelineStageOptions options = {}) {
+    checkNotBuilt();
+
+    if (0 == options.workers) {
+      throw std::invalid_argument("Hal_Pipeline stage needs a worker");
+    }
+
+    auto stage = std::make_unique<Stage>();
+    stage->name = name;
+    stage->fn = std::move(fn);
+    stage->options = options;
+    stage->traceName = Hal_Trace::intern(m_name + "-" + stage->name);
+
+    m_stages.push_back(std::move(stage));
+
+    return m_stages.size() - 1;
+  }
+
+  void connect(size_t from, size_t to) {
+    checkNotBuilt();
+    checkStage(from);
+    checkStage(to);
+
+    if constexpr (!std::is_copy_constructible_v<T>) {
+      if (!m_stages[from]->next.empty()) {
+        throw std::logic_error(
+            "Hal_Pipeline can not fan out items that are not copyable");
+      }
+    }
+
+    m_stages[from]->next.push_back(to);
+    m_stages[to]->upstreams++;
+  }
+
+  /**
+   * Plans the fusion of the stages and starts the threads of the queued
+   * stages, the graph can not be changed afterward.
+   */
+  void build() {
+    checkNotBuilt();
+
+    sortStages();
+
+    for (size_t index : m_order) {
+      Stage &stage = *m_stages[index];
+
+      if (isFused(stage)) {
+        stage.group = m_stages[stage.upstream]->group;
+        m_stages[stage.group]->groupName += "+" + stage.name;
+      } else {
+        stage.group = index;
+        stage.groupName = stage.name;
+      }
+    }
+
+    for (size_t index : m_order) {
+      Stage &stage = *m_stages[index];
+
+      if (stage.group != index) {
+        continue;
+      }
+
+      bool singleWriter =
+          1 == stage.upstreams && 1 == stage.options.workers &&
+          1 == m_stages[m_stages[stage.upstream]->group]->options.workers;
+
+      if (singleWriter) {
+        stage.queue = std::make_unique<Queue<Hal_RingBuffer<T>>>(this, index);
+      } else {
+        stage.queue = std::make_unique<Queue<Hal_Buffer<T>>>(this, index);
+      }
+    }
+
+    m_built = true;
+  }
+
+  /**
+   * Writes an item to an entry stage (a stage without upstream).
+   */
+  void write(size_t stage, T &&item) { entry(stage).write(std::move(item)); }
+
+  void write(size_t stage, const T &item) { entry(stage).write(T{item}); }
+
+  /**
+   * Waits until every item written so far has passed through the pipeline,
+   * the queues are drained from upstream to downstream.
+   */
+  void waitForEmpty() {
+    checkBuilt();
+
+    for (size_t index : m_order) {
+      if (m_stages[index]->queue) {
+        m_stages[index]->queue->waitForEmpty();
+      }
+    }
+  }
+
+  /**
+   * The queued stage groups in topological order, e.g.
+   * "staging | filter+cal | out".
+   */
+  std::string describe() const {
+    std::string plan{};
+
+    checkBuilt();
+
+    for (size_t index : m_order) {
+      if (m_stages[index]->queue) {
+        plan += (plan.empty() ? "" : " | ") + m_stages[index]->groupName;
+      }
+    }
+
+    return plan;
+  }
+
+  const std::string &getName() const { return m_name; }
+
+private:
+  static constexpr long kDefaultFuseBelowUs = 10;
+
+  class QueueBase {
+  public:
+    virtual ~QueueBase() = default;
+
+    virtual void write(T &&item) = 0;
+    virtual void waitForEmpty() = 0;
+  };
+
+  template <typename Buffer> class Queue : public QueueBase {
+  public:
+    Queue(Hal_Pipeline *pipeline, size_t stage)
+        : m_pipe{pipeline->m_name + "-" + pipeline->m_stages[stage]->groupName,
+                 [pipeline, stage](T &&item) {
+                   pipeline->run(stage, std::move(item));
+                 },
+                 pipeline->m_stages[stage]->options.workers,
+                 pipeline->m_stages[stage]->options.proc} {}
+
+    void write(T &&item) override { m_pipe.write(std::move(item)); }
+
+    void waitForEmpty() override { m_pipe.waitForEmpty(); }
+
+  private:
+    Hal_Pipe<T, Buffer> m_pipe;
+  };
+
+  struct Stage {
+    std::string name{};
+    Task fn{};
+    uint32_t traceName{};
+    Hal_PipelineStageOptions options{};
+    std::vector<size_t> next{};
+    size_t upstreams{};
+    size_t upstream{}; // the first upstream stage, once sorted
+    size_t group{};    // the queued stage it runs in
+    std::string groupName{};
+    std::unique_ptr<QueueBase> queue{};
+  };
+
+  bool isFused(const Stage &stage) const {
+    if (1 != stage.upstreams || 1 != stage.options.workers) {
+      return false;
+    }
+
+    switch (stage.options.fusion) {
+    case Hal_PipelineFusion::Always:
+      return true;
+
+    case Hal_PipelineFusion::Never:
+      return false;
+
+    case Hal_PipelineFusion::Auto:
+      break;
+    }
+
+    // a cheap stage run by several upstream workers would have to be thread
+    // safe, so only fuse it automatically onto a single thread.
+    const Stage &group = *m_stages[m_stages[stage.upstream]->group];
+
+    return 1 == group.options.workers && stage.options.cost < m_fuseBelow;
+  }
+
+  // Kahn's algorithm, it also records the first upstream of every stage.
+  void sortStages() {
+    std::vector<size_t> pending(m_stages.size());
+
+    for (size_t index = 0; index < m_stages.size(); index++) {
+      pending[index] = m_stages[index]->upstreams;
+
+      if (0 == pending[index]) {
+        m_order.push_back(index);
+      }
+    }
+
+    for (size_t i = 0; i < m_order.size(); i++) {
+      for (size_t next : m_stages[m_order[i]]->next) {
+        if (m_stages[next]->upstreams == pending[next]) {
+          m_stages[next]->upstream = m_order[i];
+        }
+
+        if (0 == --pending[next]) {
+          m_order.push_back(next);
+        }
+      }
+    }
+
+    if (m_order.size() != m_stages.size()) {
+      m_order.clear();
+
+      throw std::logic_error("Hal_Pipeline graph has a cycle");
+    }
+  }
+
+  void run(size_t index, T &&item) {
+    Emit emit{this, index};
+    uint32_t traceName = m_stages[index]->traceName;
+
+    // the stages fused downstream run nested in it, on the same thread
+    Hal_Trace::record(traceName, Hal_TraceEvent::ProcessBegin);
+
+    m_stages[index]->fn(std::move(item), emit);
+
+    Hal_Trace::record(traceName, Hal_TraceEvent::ProcessEnd);
+  }
+
+  void emit(size_t index, T &&item) {
+    const std::vector<size_t> &next = m_stages[index]->next;
+
+    for (size_t i = 0; i < next.size(); i++) {
+      if (i + 1 == next.size()) {
+        forward(next[i], std::move(item));
+      } else if constexpr (std::is_copy_constructible_v<T>) {
+        forward(next[i], T{item});
+      }
+    }
+  }
+
+  void forward(size_t index, T &&item) {
+    Stage &stage = *m_stages[index];
+
+    if (stage.queue) {
+      stage.queue->write(std::move(item));
+    } else {
+      run(index, std::move(item));
+    }
+  }
+
+  QueueBase &entry(size_t stage) {
+    checkBuilt();
+    checkStage(stage);
+
+    if (0 != m_stages[stage]->upstreams) {
+      throw std::logic_error("Hal_Pipeline stage " + m_stages[stage]->name +
+                             " is not an entry stage");
+    }
+
+    return *m_stages[stage]->queue;
+  }
+
+  void checkStage(size_t stage) const {
+    if (stage >= m_stages.size()) {
+      throw std::out_of_range("Hal_Pipeline has no such stage");
+    }
+  }
+
+  void checkBuilt() const {
+    if (!m_built) {
+      throw std::logic_error("Hal_Pipeline is not built");
+    }
+  }
+
+  void checkNotBuilt() const {
+    if (m_built) {
+      throw std::logic_error("Hal_Pipeline is already built");
+    }
+  }
+
+  const std::string m_name{};
+  const std::chrono::nanoseconds m_fuseBelow{};
+  std::vector<std::unique_ptr<Stage>> m_stages{};
+  std::vector<size_t> m_order{};
+  bool m_built{};
+};
+
+#endif /* HAL_PIPELINE_HPP_HAVE_SEEN */
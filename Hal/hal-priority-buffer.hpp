@@ -0,0 +1,405 @@
+/**
+ * This module implements Hal_PriorityBuffer, an unbounded multi-producer/
+ * multi-consumer buffer that pops the most urgent item first rather than the
+ * oldest, so that a control message is not queued behind bulk data:
+ *
+ * - Priority order pops the highest priority first (FIFO within a
+ *   priority). With aging, an item gains one priority level per aging
+ *   interval it waits, so a steady stream of high priority items can not
+ *   starve the low priority ones.
+ * - EarliestDeadline order pops the earliest deadline first, with aging an
+ *   item pushed without a deadline is given one of its push time plus the
+ *   aging interval, else it waits for all the items with a deadline.
+ *
+ * Aging is done by ranking an item by its push time less its priority times
+ * the aging interval once at push, so the heap never has to be reordered.
+ *
+ * An item with a deadline that is popped after it is counted as a deadline
+ * miss, with how late it is.
+ */
+
+#ifndef HAL_PRIORITY_BUFFER_HPP_HAVE_SEEN
+
+#define HAL_PRIORITY_BUFFER_HPP_HAVE_SEEN
+
+#include "hal-metrics.hpp"
+#include "hal-proc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+enum class Hal_PriorityOrder { Priority, EarliestDeadline };
+
+struct Hal_DeadlineSnapshot {
+  uint64_t met{};
+  uint64_t missed{};
+  Hal_HistogramSnapshot lateness{}; // of the missed deadlines, ns
+};
+
+template <typename T> class Hal_PriorityBuffer {
+public:
+  using Deadline = std::chrono::steady_clock::time_point;
+
+  static constexpr int kDefaultPriority = 0;
+
+  Hal_PriorityBuffer(
+      Hal_PriorityOrder order = Hal_PriorityOrder::Priority,
+      std::chrono::nanoseconds aging = std::chrono::nanoseconds::zero())
+      : m_order{order}, m_aging{aging.count()} {
+    int err{};
+
+    err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_cond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_emptyCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  virtual ~Hal_PriorityBuffer() {
+    pthread_cond_destroy(&m_emptyCond);
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  Hal_PriorityBuffer(const Hal_PriorityBuffer<T> &halPriorityBuffer) = delete;
+  const Hal_PriorityBuffer<T> &
+  operator=(const Hal_PriorityBuffer<T> &halPriorityBuffer) = delete;
+  Hal_PriorityBuffer(Hal_PriorityBuffer<T> &&halPriorityBuffer) = delete;
+  Hal_PriorityBuffer<T> &
+  operator=(Hal_PriorityBuffer<T> &&halPriorityBuffer) = delete;
+
+  // moves from rItem if T's move constructor does not throw, copies it
+  // otherwise.
+  void push(T &rItem) { emplace(std::move_if_noexcept(rItem)); }
+
+  void push(T &&item) { emplace(std::move(item)); }
+
+  /**
+   * Constructs the item at the default priority without a deadline.
+   */
+  template <typename... Args> void emplace(Args &&...args) {
+    insert(kDefaultPriority, kNoDeadline, std::forward<Args>(args)...);
+  }
+
+  void pushWithPriority(T &&item, int priority) {
+    insert(priority, kNoDeadline, std::move(item));
+  }
+
+  void pushWithDeadline(T &&item, Deadline deadline,
+                        int priority = kDefaultPriority) {
+    insert(priority, toNs(deadline), std::move(item));
+  }
+
+  template <typename InputIt> void pushBatch(InputIt first, InputIt last) {
+    int err{};
+    uint64_t pushTime = Hal_Metrics::now();
+
+    if (first == last) {
+      return;
+    }
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    long long pushCount = m_pushCount;
+
+    for (; first != last; ++first) {
+      try {
+        m_heap.push_back(makeEntry(kDefaultPriority, kNoDeadline, pushTime,
+                                   std::move_if_noexcept(*first)));
+      } catch (...) {
+        // the items pushed before the failed one stay, and are popped as
+        // usual by a consumer waiting for them
+        m_metrics.pushed(m_pushCount - pushCount, m_heap.size());
+        pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        throw;
+      }
+
+      std::push_heap(m_heap.begin(), m_heap.end(), &Hal_PriorityBuffer::later);
+
+      ++m_pushCount;
+    }
+
+    m_metrics.pushed(m_pushCount - pushCount, m_heap.size());
+
+    err = pthread_cond_broadcast(&m_cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  long long waitForEmpty() {
+    int err{};
+    long long count{};
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    while (!m_heap.empty()) {
+      err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    }
+
+    assert(m_popCount == m_pushCount);
+    count = m_popCount;
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    return count;
+  }
+
+  T pop() { return std::move(popBatch(1).front()); }
+
+  /**
+   * Pops up to maxItems in priority (or deadline) order.
+   */
+  std::vector<T> popBatch(size_t maxItems) {
+    int err{};
+    std::vector<T> items{};
+
+    assert(maxItems > 0);
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    while (m_heap.empty()) {
+      err = Hal_Proc::condWait(&m_cond, &m_mutex);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    }
+
+    uint64_t popTime = Hal_Metrics::now();
+    size_t count = std::min(maxItems, m_heap.size());
+
+    items.reserve(count);
+
+    for (size_t i = 0; i < count; i++) {
+      std::pop_heap(m_heap.begin(), m_heap.end(), &Hal_PriorityBuffer::later);
+
+      Entry &entry = m_heap.back();
+
+      m_metrics.dequeued(entry.pushTime, popTime);
+      checkDeadline(entry, popTime);
+
+      items.push_back(std::move(entry.item));
+      m_heap.pop_back();
+    }
+
+    m_popCount += count;
+    m_metrics.popped(count);
+
+    if (m_heap.empty()) {
+      err = pthread_cond_broadcast(&m_emptyCond);
+      if (err) {
+        pthread_mutex_unlock(&m_mutex);
+
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    return items;
+  }
+
+  /**
+   * Changes the order and the aging interval, the queued items are ranked
+   * again.
+   */
+  void setOrder(Hal_PriorityOrder order, std::chrono::nanoseconds aging =
+                                             std::chrono::nanoseconds::zero()) {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_order = order;
+    m_aging = aging.count();
+
+    for (auto &entry : m_heap) {
+      entry.rank = rank(entry.priority, entry.deadline, entry.pushTime);
+    }
+
+    std::make_heap(m_heap.begin(), m_heap.end(), &Hal_PriorityBuffer::later);
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  Hal_DeadlineSnapshot deadlines() const {
+    Hal_DeadlineSnapshot deadlines{};
+
+    deadlines.met = m_deadlinesMet.load(std::memory_order_relaxed);
+    deadlines.missed = m_deadlinesMissed.load(std::memory_order_relaxed);
+    deadlines.lateness = m_lateness.snapshot();
+
+    return deadlines;
+  }
+
+  Hal_Metrics &metrics() { return m_metrics; }
+
+private:
+  static constexpr int64_t kNoDeadline = std::numeric_limits<int64_t>::max();
+
+  struct Entry {
+    int64_t rank{}; // the lower the more urgent
+    uint64_t seq{}; // FIFO among the same rank
+    int priority{};
+    int64_t deadline{};
+    uint64_t pushTime{};
+    T item;
+  };
+
+  static int64_t toNs(Deadline deadline) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               deadline.time_since_epoch())
+        .count();
+  }
+
+  // the heap comparator, the top is the entry that is not later than any
+  static bool later(const Entry &lhs, const Entry &rhs) {
+    return lhs.rank != rhs.rank ? lhs.rank > rhs.rank : lhs.seq > rhs.seq;
+  }
+
+  int64_t rank(int priority, int64_t deadline, uint64_t pushTime) const {
+    if (Hal_PriorityOrder::EarliestDeadline == m_order) {
+      if (kNoDeadline == deadline && m_aging > 0) {
+        return (int64_t)pushTime + m_aging;
+      }
+
+      return deadline;
+    }
+
+    if (m_aging > 0) {
+      return (int64_t)pushTime - (int64_t)priority * m_aging;
+    }
+
+    return -(int64_t)priority;
+  }
+
+  template <typename... Args>
+  Entry makeEntry(int priority, int64_t deadline, uint64_t pushTime,
+                  Args &&...args) {
+    return Entry{rank(priority, deadline, pushTime),
+                 m_seq++,
+                 priority,
+                 deadline,
+                 pushTime,
+                 T(std::forward<Args>(args)...)};
+  }
+
+  template <typename... Args>
+  void insert(int priority, int64_t deadline, Args &&...args) {
+    int err{};
+    uint64_t pushTime = Hal_Metrics::now();
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    try {
+      m_heap.push_back(makeEntry(priority, deadline, pushTime,
+                                 std::forward<Args>(args)...));
+    } catch (...) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw;
+    }
+
+    std::push_heap(m_heap.begin(), m_heap.end(), &Hal_PriorityBuffer::later);
+
+    ++m_pushCount;
+    m_metrics.pushed(1, m_heap.size());
+
+    err = pthread_cond_signal(&m_cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  void checkDeadline(const Entry &entry, uint64_t popTime) {
+    if (kNoDeadline == entry.deadline) {
+      return;
+    }
+
+    if ((int64_t)popTime <= entry.deadline) {
+      m_deadlinesMet.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      m_deadlinesMissed.fetch_add(1, std::memory_order_relaxed);
+      m_lateness.record(popTime - entry.deadline);
+    }
+  }
+
+  Hal_PriorityOrder m_order{};
+  int64_t m_aging{};
+  std::vector<Entry> m_heap{};
+  uint64_t m_seq{};
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_cond{};
+  pthread_cond_t m_emptyCond{};
+  long long m_pushCount{};
+  long long m_popCount{};
+  Hal_Metrics m_metrics{};
+  std::atomic<uint64_t> m_deadlinesMet{};
+  std::atomic<uint64_t> m_deadlinesMissed{};
+  Hal_Histogram m_lateness{};
+};
+
+#endif /* HAL_PRIORITY_BUFFER_HPP_HAVE_SEEN */
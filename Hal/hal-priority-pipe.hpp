@@ -0,0 +1,67 @@
+/**
+ * This module implements Hal_PriorityPipe, a Hal_Pipe over a
+ * Hal_PriorityBuffer, so that its thread(s) process the most urgent item
+ * first, e.g. a control message is handled before the bulk data written
+ * ahead of it. A plain write() is at the default priority without a
+ * deadline.
+ */
+
+#ifndef HAL_PRIORITY_PIPE_HPP_HAVE_SEEN
+
+#define HAL_PRIORITY_PIPE_HPP_HAVE_SEEN
+
+#include "hal-pipe.hpp"
+#include "hal-priority-buffer.hpp"
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+#include "hal-trace.hpp"
+
+#include <chrono>
+#include <string_view>
+#include <utility>
+
+template <typename T>
+class Hal_PriorityPipe : public Hal_Pipe<T, Hal_PriorityBuffer<T>> {
+  using Task = Hal_Task<void(T &&)>;
+
+public:
+  using Deadline = typename Hal_PriorityBuffer<T>::Deadline;
+
+  Hal_PriorityPipe(
+      std::string_view name, Hal_PriorityPipe::Task fn = {},
+      Hal_PriorityOrder order = Hal_PriorityOrder::Priority,
+      std::chrono::nanoseconds aging = std::chrono::nanoseconds::zero(),
+      size_t workers = 1, Hal_ProcOptions options = {})
+      : Hal_Pipe<T, Hal_PriorityBuffer<T>>{name, std::move(fn), workers,
+                                           std::move(options)} {
+    this->setOrder(order, aging);
+  }
+
+  Hal_PriorityPipe(const Hal_PriorityPipe &halPriorityPipe) = delete;
+  const Hal_PriorityPipe &
+  operator=(const Hal_PriorityPipe &halPriorityPipe) = delete;
+  Hal_PriorityPipe(Hal_PriorityPipe &&halPriorityPipe) = delete;
+  Hal_PriorityPipe &operator=(Hal_PriorityPipe &&halPriorityPipe) = delete;
+
+  using Hal_Pipe<T, Hal_PriorityBuffer<T>>::write;
+
+  /**
+   * The higher the priority the sooner the item is processed.
+   */
+  void write(T &&item, int priority) {
+    Hal_Trace::record(this->m_traceName, Hal_TraceEvent::Push);
+    this->pushWithPriority(std::move(item), priority);
+  }
+
+  /**
+   * The item counts as a deadline miss if it is not taken by the pipe
+   * thread by the deadline.
+   */
+  void writeBefore(T &&item, Deadline deadline,
+                   int priority = Hal_PriorityBuffer<T>::kDefaultPriority) {
+    Hal_Trace::record(this->m_traceName, Hal_TraceEvent::Push);
+    this->pushWithDeadline(std::move(item), deadline, priority);
+  }
+};
+
+#endif /* HAL_PRIORITY_PIPE_HPP_HAVE_SEEN */
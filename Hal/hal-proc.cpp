@@ -1,21 +1,34 @@
 #include "hal-proc.hpp"
 
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <exception>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 
 #include <pthread.h>
 #include <sched.h>
+#include <time.h>
+
+// the Hal_Proc that runs the calling thread, if any.
+static thread_local Hal_Proc *t_proc{};
+
+Hal_Proc::Hal_Proc(std::string_view name, Hal_Proc::Task fn,
+                   Hal_ProcOptions options)
+    : m_name{name}, m_options{std::move(options)} {
+  int err = pthread_mutex_init(&m_waitMutex, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
 
-Hal_Proc::Hal_Proc(std::string_view name, Hal_Proc::Task fn) : m_name{name} {
   setState(State::New);
 
   if (fn) {
-    setTask(fn);
+    setTask(std::move(fn));
   }
 }
 
@@ -24,6 +37,8 @@ Hal_Proc::~Hal_Proc() noexcept try {
     stopExec();
   }
 
+  pthread_mutex_destroy(&m_waitMutex);
+
   setState(State::Invalid);
 } catch (...) {
   // explicit return to resolve exception as destructor must be noexcept
@@ -32,12 +47,76 @@ Hal_Proc::~Hal_Proc() noexcept try {
 
 bool Hal_Proc::exec(Hal_Proc::Task fn) {
   if (fn) {
-    setTask(fn);
+    setTask(std::move(fn));
   }
 
   return runExec();
 }
 
+const std::string &Hal_Proc::getName() const { return m_name; }
+
+void Hal_Proc::requestStop() {
+  m_stopRequested.store(true, std::memory_order_seq_cst);
+
+  wakeUp();
+}
+
+void Hal_Proc::wakeUp() {
+  int err = pthread_mutex_lock(&m_waitMutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  // the waiting thread holds the mutex of its condition variable while it
+  // (un)registers itself, so the mutex is only tried while holding
+  // m_waitMutex. A broadcast with it held can not be missed, one without it
+  // wakes the thread if another thread holds the mutex (the waiting thread
+  // is then parked), but not if the waiting thread holds it and is about to
+  // park, so the wake up stays pending for wait() to send again.
+  if (nullptr != m_waitCond) {
+    if (0 == pthread_mutex_trylock(m_waitCondMutex)) {
+      pthread_cond_broadcast(m_waitCond);
+      pthread_mutex_unlock(m_waitCondMutex);
+
+      m_wakePending = false;
+    } else {
+      pthread_cond_broadcast(m_waitCond);
+
+      m_wakePending = true;
+    }
+  }
+
+  err = pthread_mutex_unlock(&m_waitMutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+bool Hal_Proc::isWakePending() {
+  int err = pthread_mutex_lock(&m_waitMutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  bool pending = m_wakePending;
+
+  err = pthread_mutex_unlock(&m_waitMutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  return pending;
+}
+
+bool Hal_Proc::stopRequested() {
+  return nullptr != t_proc &&
+         t_proc->m_stopRequested.load(std::memory_order_acquire);
+}
+
+Hal_Proc *Hal_Proc::getCurrent() { return t_proc; }
+
+bool Hal_Proc::isRunning() const { return getState() == State::Running; }
+
 Hal_Proc::State Hal_Proc::getState() const { return m_state; }
 
 Hal_Proc::State Hal_Proc::setState(State state) {
@@ -51,7 +130,7 @@ Hal_Proc::State Hal_Proc::setState(State state) {
 void Hal_Proc::setTask(Hal_Proc::Task fn) {
   assert(getState() == State::New || getState() == State::Ready);
 
-  this->m_fn = fn;
+  this->m_fn = std::move(fn);
   setState(State::Ready);
 }
 
@@ -63,7 +142,12 @@ bool Hal_Proc::wait() {
     throw std::runtime_error("No task is exec");
   }
 
-  err = pthread_join(m_th, &pRet);
+  if (m_stopRequested.load(std::memory_order_acquire)) {
+    err = joinStopped(&pRet);
+  } else {
+    err = pthread_join(m_th, &pRet);
+  }
+
   if (err) {
     std::cerr << strerror(err) << "\n";
   }
@@ -73,23 +157,136 @@ bool Hal_Proc::wait() {
   return 0 == err;
 }
 
+void Hal_Proc::setOptions(Hal_ProcOptions options) {
+  int err{};
+
+  m_options = std::move(options);
+
+  if (getState() != State::Running) {
+    return;
+  }
+
+  cpu_set_t cpuSet{};
+
+  CPU_ZERO(&cpuSet);
+  if (m_options.cpus.empty()) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, &cpuSet);
+    }
+  } else {
+    for (int cpu : m_options.cpus) {
+      CPU_SET(cpu, &cpuSet);
+    }
+  }
+
+  err = pthread_setaffinity_np(m_th, sizeof(cpuSet), &cpuSet);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  struct sched_param param{};
+
+  param.sched_priority = m_options.priority;
+
+  err = pthread_setschedparam(m_th, m_options.policy, &param);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
 void Hal_Proc::yield() {
-  pthread_testcancel();
+  if (stopRequested()) {
+    throw Hal_StopException{};
+  }
+
   sched_yield();
 }
 
-bool Hal_Proc::stopExec() {
+int Hal_Proc::condWait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  return waitForCond(cond, mutex, nullptr);
+}
+
+int Hal_Proc::condTimedWait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                            const struct timespec *abstime) {
+  return waitForCond(cond, mutex, abstime);
+}
+
+int Hal_Proc::waitForCond(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          const struct timespec *abstime) {
   int err{};
+  Hal_Proc *proc = t_proc;
 
-  if (getState() != State::Running) {
-    throw std::runtime_error("No task is exec");
+  if (nullptr == proc) {
+    return nullptr == abstime ? pthread_cond_wait(cond, mutex)
+                              : pthread_cond_timedwait(cond, mutex, abstime);
+  }
+
+  // register before checking the stop flag, requestStop sets the flag before
+  // looking for the registration, so one of us always sees the other.
+  proc->setWaitingOn(cond, mutex);
+
+  if (!proc->m_stopRequested.load(std::memory_order_seq_cst)) {
+    err = nullptr == abstime ? pthread_cond_wait(cond, mutex)
+                             : pthread_cond_timedwait(cond, mutex, abstime);
+  }
+
+  proc->setWaitingOn(nullptr, nullptr);
+
+  if (proc->m_stopRequested.load(std::memory_order_acquire)) {
+    pthread_mutex_unlock(mutex);
+
+    throw Hal_StopException{};
   }
 
-  err = pthread_cancel(m_th);
+  return err;
+}
+
+void Hal_Proc::setWaitingOn(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  int err = pthread_mutex_lock(&m_waitMutex);
   if (err) {
-    std::cerr << strerror(err) << "\n";
+    throw std::runtime_error(strerror(err));
+  }
+
+  m_waitCond = cond;
+  m_waitCondMutex = mutex;
+  m_wakePending = false;
+
+  err = pthread_mutex_unlock(&m_waitMutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+int Hal_Proc::joinStopped(void **pRet) {
+  while (true) {
+    struct timespec abstime{};
+
+    clock_gettime(CLOCK_REALTIME, &abstime);
+
+    abstime.tv_nsec += kWakeRetryNs;
+    if (abstime.tv_nsec >= 1000000000L) {
+      abstime.tv_sec++;
+      abstime.tv_nsec -= 1000000000L;
+    }
+
+    int err = pthread_timedjoin_np(m_th, pRet, &abstime);
+    if (ETIMEDOUT != err) {
+      return err;
+    }
+
+    if (isWakePending()) {
+      wakeUp();
+    }
+  }
+}
+
+bool Hal_Proc::stopExec() {
+  if (getState() != State::Running) {
+    throw std::runtime_error("No task is exec");
   }
 
+  requestStop();
+
   return wait();
 }
 
@@ -102,8 +299,15 @@ bool Hal_Proc::runExec() {
                              ")");
   }
 
+  pthread_attr_t attr{};
+
+  initAttr(&attr);
+
+  m_stopRequested.store(false, std::memory_order_relaxed);
+
   oldstate = setState(State::Running);
-  err = pthread_create(&m_th, NULL, &(Hal_Proc::runFnInThreadHelper), this);
+  err = pthread_create(&m_th, &attr, &(Hal_Proc::runFnInThreadHelper), this);
+  pthread_attr_destroy(&attr);
   if (err) {
     setState(oldstate);
     return false;
@@ -113,22 +317,75 @@ bool Hal_Proc::runExec() {
 }
 
 void *Hal_Proc::runFnInThreadHelper(void *context) {
-  Hal_Proc *proc{};
-  int oldstate{};
-  int err{};
+  Hal_Proc *proc = (Hal_Proc *)context;
 
-  err = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-  if (err) {
-    throw std::runtime_error(strerror(err));
+  t_proc = proc;
+
+  // the name is only for perf or top, so failing to set it is not fatal
+  pthread_setname_np(pthread_self(), proc->m_name.substr(0, 15).c_str());
+
+  try {
+    proc->m_fn();
+  } catch (const Hal_StopException &) {
+    // the thread is asked to stop, and has unwound its functor
   }
 
-  err = pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &oldstate);
+  return NULL;
+}
+
+void Hal_Proc::initAttr(pthread_attr_t *attr) const {
+  int err{};
+
+  err = pthread_attr_init(attr);
   if (err) {
     throw std::runtime_error(strerror(err));
   }
 
-  proc = (Hal_Proc *)context;
-  proc->m_fn();
-
-  return NULL;
+  try {
+    if (m_options.stackSize > 0) {
+      err = pthread_attr_setstacksize(attr, m_options.stackSize);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    if (!m_options.cpus.empty()) {
+      cpu_set_t cpuSet{};
+
+      CPU_ZERO(&cpuSet);
+      for (int cpu : m_options.cpus) {
+        CPU_SET(cpu, &cpuSet);
+      }
+
+      err = pthread_attr_setaffinity_np(attr, sizeof(cpuSet), &cpuSet);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+
+    if (SCHED_OTHER != m_options.policy || 0 != m_options.priority) {
+      struct sched_param param{};
+
+      param.sched_priority = m_options.priority;
+
+      err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      err = pthread_attr_setschedpolicy(attr, m_options.policy);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+
+      err = pthread_attr_setschedparam(attr, &param);
+      if (err) {
+        throw std::runtime_error(strerror(err));
+      }
+    }
+  } catch (...) {
+    pthread_attr_destroy(attr);
+
+    throw;
+  }
 }
@@ -10,28 +10,65 @@
 
 #define HAL_PROC_HPP_HAVE_SEEN
 
-#include <functional>
+#include "hal-task.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/**
+ * How the thread of a Hal_Proc runs, so that e.g. a latency critical pipe
+ * stage can be pinned to dedicated cores away from bulk stages.
+ */
+struct Hal_ProcOptions {
+  std::vector<int> cpus{};  // CPUs the thread may run on, empty for any CPU
+  int policy{SCHED_OTHER};  // SCHED_OTHER, SCHED_BATCH, SCHED_FIFO, SCHED_RR
+  int priority{};           // static priority of SCHED_FIFO and SCHED_RR
+  size_t stackSize{};       // 0 for the default stack size
+};
+
+/**
+ * Thrown by Hal_Proc::condWait, condTimedWait and yield in a Hal_Proc thread
+ * that is asked to stop, so the thread function unwinds (running destructors
+ * on the way) up to Hal_Proc, which then ends the thread.
+ */
+class Hal_StopException : public std::exception {
+public:
+  const char *what() const noexcept override {
+    return "Hal_Proc stop is requested";
+  }
+};
 
 /**
- * Hal_Proc thread cancellation via (StopExec) is synchronous, so if the functor
- * runs infinitely without any pthread cancellation point, we should voluntarily
- * call Hal_Proc::yield() at different point in time in the loop.
+ * Hal_Proc threads stop cooperatively rather than by pthread_cancel, a stop
+ * request (requestStop or stopExec) sets a stop flag and wakes up the thread
+ * if it is blocked in Hal_Proc::condWait. The thread then sees the stop at
+ * its next condWait, condTimedWait or yield (Hal_StopException), or when it
+ * polls Hal_Proc::stopRequested(), so if the functor runs infinitely without
+ * waiting, it should call Hal_Proc::yield() or check stopRequested() from
+ * time to time in the loop.
+ *
+ * It is RAII model where in destruction of Hal_Proc object, it will request
+ * the thread to stop and join it to free resource.
  *
- * It is RAII model where in destruction of Hal_Proc object, it will try to
- * cancel the thread and join it to free resource, so the thread should respond
- * to pthread cancellation.
+ * The thread is named after the Hal_Proc (truncated to the 15 characters
+ * allowed by pthread_setname_np), so that it can be identified in perf or top.
  */
 class Hal_Proc {
-  using Task = std::function<void()>;
+  using Task = Hal_Task<void()>;
 
   enum State { Invalid, New, Ready, Running };
 
 public:
-  Hal_Proc(std::string_view name, Hal_Proc::Task fn = {});
+  Hal_Proc(std::string_view name, Hal_Proc::Task fn = {},
+           Hal_ProcOptions options = {});
   virtual ~Hal_Proc() noexcept;
 
   Hal_Proc(const Hal_Proc &halProc) = delete;
@@ -42,8 +79,52 @@ public:
   bool exec(Hal_Proc::Task fn = {});
   bool wait();
 
+  const std::string &getName() const;
+
+  /**
+   * Asks the thread to stop without waiting for it, e.g. to stop a group of
+   * threads together before joining them one by one. It never blocks on the
+   * mutex of the condition variable that the thread waits on, so it may be
+   * called with that mutex held.
+   */
+  void requestStop();
+
+  /**
+   * True if the Hal_Proc running the calling thread is asked to stop, false
+   * for a thread that is not run by a Hal_Proc.
+   */
+  static bool stopRequested();
+
+  /**
+   * The Hal_Proc running the calling thread, nullptr for a thread that is
+   * not run by a Hal_Proc.
+   */
+  static Hal_Proc *getCurrent();
+
+  bool isRunning() const;
+
+  /**
+   * Applies the CPU set and scheduling policy to the running thread at once,
+   * the stack size takes effect at the next exec.
+   */
+  virtual void setOptions(Hal_ProcOptions options);
+
   static void yield();
 
+  /**
+   * pthread_cond_wait that a stop request of the calling Hal_Proc thread
+   * wakes up, it then releases the mutex and throws Hal_StopException, so
+   * that other threads blocked on the same mutex (e.g. the workers of a
+   * Hal_Pipe) can still be stopped and joined.
+   */
+  static int condWait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+
+  /**
+   * condWait with an absolute timeout, returns ETIMEDOUT if it expires.
+   */
+  static int condTimedWait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime);
+
 protected:
   Hal_Proc::State getState() const;
   Hal_Proc::State setState(Hal_Proc::State state);
@@ -53,12 +134,34 @@ protected:
   bool runExec();
 
 private:
+  // how often wait() sends again a wake up that a stop request could not
+  // be sure to deliver.
+  static constexpr long kWakeRetryNs = 1000000;
+
   static void *runFnInThreadHelper(void *context);
+  static int waitForCond(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                         const struct timespec *abstime);
+
+  void setWaitingOn(pthread_cond_t *cond, pthread_mutex_t *mutex);
+  void wakeUp();
+  bool isWakePending();
+  int joinStopped(void **pRet);
+
+  void initAttr(pthread_attr_t *attr) const;
 
   const std::string m_name{};
+  Hal_ProcOptions m_options{};
   Hal_Proc::Task m_fn{};
   Hal_Proc::State m_state{};
   pthread_t m_th{};
+  std::atomic<bool> m_stopRequested{};
+
+  // the condition variable (and its mutex) the thread is blocked on, guarded
+  // by m_waitMutex, so that a stop request can wake the thread up.
+  pthread_mutex_t m_waitMutex{};
+  pthread_cond_t *m_waitCond{};
+  pthread_mutex_t *m_waitCondMutex{};
+  bool m_wakePending{};
 };
 
 #endif /* HAL_PROC_HPP_HAVE_SEEN */
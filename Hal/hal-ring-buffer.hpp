@@ -0,0 +1,349 @@
+/**
+ * This module implements a bounded single-producer/single-consumer ring
+ * buffer with the same push/pop/waitForEmpty protocol as Hal_Buffer, so that
+ * it can be selected as the queue backend of Hal_Pipe at compile time, e.g.
+ * Hal_Pipe<std::string, Hal_RingBuffer<std::string>>.
+ *
+ * The producer only writes m_tail and the consumer only writes m_head, both
+ * counters live on their own cache line, and neither side takes a lock as
+ * long as the ring is neither empty (pop) nor full (push). Only when a thread
+ * has to wait, it parks on a pthread condition variable after announcing
+ * itself in a parked counter, and the other side only takes the mutex to
+ * wake it up if it observes that counter being non-zero (futex style).
+ *
+ * Exactly one thread may push and exactly one thread may pop at a time.
+ */
+
+#ifndef HAL_RING_BUFFER_HPP_HAVE_SEEN
+
+#define HAL_RING_BUFFER_HPP_HAVE_SEEN
+
+#include "hal-metrics.hpp"
+#include "hal-proc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+template <typename T, size_t Capacity = 1024> class Hal_RingBuffer {
+  static_assert(Capacity > 0 && 0 == (Capacity & (Capacity - 1)),
+                "Hal_RingBuffer capacity must be a power of 2");
+
+  static constexpr size_t kCacheLineSize = 64;
+
+  struct Slot {
+    alignas(T) unsigned char data[sizeof(T)];
+  };
+
+public:
+  // a Hal_Pipe over it refuses more than one worker
+  static constexpr bool kSingleConsumer = true;
+
+  Hal_RingBuffer() : m_slots{std::make_unique<Slot[]>(Capacity)} {
+    int err{};
+
+    if (m_metrics.isRecording()) {
+      m_pushTimes = std::make_unique<uint64_t[]>(Capacity);
+    }
+
+    err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_popCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_pushCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_emptyCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  virtual ~Hal_RingBuffer() {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+
+    for (; head != tail; ++head) {
+      slot(head)->~T();
+    }
+
+    pthread_cond_destroy(&m_emptyCond);
+    pthread_cond_destroy(&m_pushCond);
+    pthread_cond_destroy(&m_popCond);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  Hal_RingBuffer(const Hal_RingBuffer &halRingBuffer) = delete;
+  const Hal_RingBuffer &operator=(const Hal_RingBuffer &halRingBuffer) = delete;
+  Hal_RingBuffer(Hal_RingBuffer &&halRingBuffer) = delete;
+  Hal_RingBuffer &operator=(Hal_RingBuffer &&halRingBuffer) = delete;
+
+  // moves from rItem if T's move constructor does not throw, copies it
+  // otherwise.
+  void push(T &rItem) { emplace(std::move_if_noexcept(rItem)); }
+
+  void push(T &&item) { emplace(std::move(item)); }
+
+  /**
+   * Constructs the item in place in the next free slot from args.
+   */
+  template <typename... Args> void emplace(Args &&...args) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    uint64_t pushTime = m_metrics.stamp();
+
+    if (tail - m_head.load(std::memory_order_acquire) >= Capacity) {
+      park(m_pushCond, m_pushParked, [this, tail]() {
+        return tail - m_head.load(std::memory_order_seq_cst) < Capacity;
+      });
+
+      pushTime = blocked(pushTime);
+    }
+
+    new (m_slots[tail & (Capacity - 1)].data) T(std::forward<Args>(args)...);
+
+    if (m_metrics.isRecording()) {
+      m_pushTimes[tail & (Capacity - 1)] = pushTime;
+    }
+    m_metrics.pushed(1, tail + 1 - m_head.load(std::memory_order_relaxed));
+
+    publishTail(tail + 1);
+  }
+
+  template <typename InputIt> void pushBatch(InputIt first, InputIt last) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    uint64_t pushTime = m_metrics.stamp();
+
+    while (first != last) {
+      if (tail - m_head.load(std::memory_order_acquire) >= Capacity) {
+        park(m_pushCond, m_pushParked, [this, tail]() {
+          return tail - m_head.load(std::memory_order_seq_cst) < Capacity;
+        });
+
+        pushTime = blocked(pushTime);
+      }
+
+      // fill all free slots before publishing the new tail, so the consumer
+      // is woken up at most once per chunk.
+      size_t head = m_head.load(std::memory_order_acquire);
+      size_t start = tail;
+      for (; first != last && tail - head < Capacity; ++first, ++tail) {
+        new (m_slots[tail & (Capacity - 1)].data)
+            T(std::move_if_noexcept(*first));
+
+        if (m_metrics.isRecording()) {
+          m_pushTimes[tail & (Capacity - 1)] = pushTime;
+        }
+      }
+
+      m_metrics.pushed(tail - start, tail - head);
+
+      publishTail(tail);
+    }
+  }
+
+  long long waitForEmpty() {
+    park(m_emptyCond, m_emptyParked, [this]() {
+      return m_head.load(std::memory_order_seq_cst) ==
+             m_tail.load(std::memory_order_seq_cst);
+    });
+
+    return m_head.load(std::memory_order_acquire);
+  }
+
+  T pop() {
+    size_t head = m_head.load(std::memory_order_relaxed);
+
+    if (head == m_tail.load(std::memory_order_acquire)) {
+      park(m_popCond, m_popParked, [this, head]() {
+        return head != m_tail.load(std::memory_order_seq_cst);
+      });
+    }
+
+    T *pItem = slot(head);
+    T val = std::move(*pItem);
+    pItem->~T();
+
+    if (m_metrics.isRecording()) {
+      m_metrics.dequeued(m_pushTimes[head & (Capacity - 1)],
+                         Hal_Metrics::now());
+    }
+
+    m_metrics.popped(1);
+
+    publishHead(head + 1);
+
+    return val; // val is local variable, hence rvalue and hence move semantic
+                // by default for efficient copy.
+  }
+
+  std::vector<T> popBatch(size_t maxItems) {
+    std::vector<T> items{};
+    size_t head = m_head.load(std::memory_order_relaxed);
+
+    assert(maxItems > 0);
+
+    if (head == m_tail.load(std::memory_order_acquire)) {
+      park(m_popCond, m_popParked, [this, head]() {
+        return head != m_tail.load(std::memory_order_seq_cst);
+      });
+    }
+
+    size_t count =
+        std::min(maxItems, m_tail.load(std::memory_order_acquire) - head);
+    items.reserve(count);
+
+    uint64_t popTime = m_metrics.stamp();
+    for (size_t end = head + count; head != end; ++head) {
+      T *pItem = slot(head);
+      items.push_back(std::move(*pItem));
+      pItem->~T();
+
+      if (m_metrics.isRecording()) {
+        m_metrics.dequeued(m_pushTimes[head & (Capacity - 1)], popTime);
+      }
+    }
+
+    m_metrics.popped(count);
+
+    publishHead(head);
+
+    return items;
+  }
+
+  Hal_Metrics &metrics() { return m_metrics; }
+
+private:
+  // records the time a push is blocked for, and returns the time it ends as
+  // the push time of the item.
+  uint64_t blocked(uint64_t waitTime) {
+    if (!m_metrics.isRecording()) {
+      return waitTime;
+    }
+
+    uint64_t now = Hal_Metrics::now();
+
+    m_metrics.blocked(now - waitTime);
+
+    return now;
+  }
+
+  void publishTail(size_t tail) {
+    m_tail.store(tail, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_popParked.load(std::memory_order_relaxed) > 0) {
+      wake(m_popCond, false);
+    }
+  }
+
+  void publishHead(size_t head) {
+    m_head.store(head, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_pushParked.load(std::memory_order_relaxed) > 0) {
+      wake(m_pushCond, false);
+    }
+
+    if (m_emptyParked.load(std::memory_order_relaxed) > 0) {
+      wake(m_emptyCond, true);
+    }
+  }
+
+  T *slot(size_t index) {
+    return std::launder(
+        reinterpret_cast<T *>(m_slots[index & (Capacity - 1)].data));
+  }
+
+  template <typename Predicate>
+  void park(pthread_cond_t &cond, std::atomic<int> &parked, Predicate pred) {
+    int err{};
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    // announce ourself before re-checking the predicate, the other side
+    // publishes its counter before checking the parked count, so one of us
+    // always sees the other.
+    parked.fetch_add(1, std::memory_order_seq_cst);
+
+    while (!pred()) {
+      try {
+        err = Hal_Proc::condWait(&cond, &m_mutex);
+      } catch (const Hal_StopException &) {
+        parked.fetch_sub(1, std::memory_order_relaxed);
+
+        throw;
+      }
+
+      if (err) {
+        parked.fetch_sub(1, std::memory_order_relaxed);
+
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    }
+
+    parked.fetch_sub(1, std::memory_order_relaxed);
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  void wake(pthread_cond_t &cond, bool all) {
+    int err{};
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = all ? pthread_cond_broadcast(&cond) : pthread_cond_signal(&cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  alignas(kCacheLineSize) std::atomic<size_t> m_head{};
+  alignas(kCacheLineSize) std::atomic<size_t> m_tail{};
+  alignas(kCacheLineSize) std::atomic<int> m_popParked{};
+  std::atomic<int> m_pushParked{};
+  std::atomic<int> m_emptyParked{};
+  std::unique_ptr<Slot[]> m_slots{};
+  std::unique_ptr<uint64_t[]> m_pushTimes{}; // null unless metrics are recorded
+  Hal_Metrics m_metrics{};
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_popCond{};
+  pthread_cond_t m_pushCond{};
+  pthread_cond_t m_emptyCond{};
+};
+
+#endif /* HAL_RING_BUFFER_HPP_HAVE_SEEN */
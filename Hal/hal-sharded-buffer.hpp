@@ -0,0 +1,588 @@
+/**
+ * This module implements Hal_ShardedBuffer, a multi-producer/single-consumer
+ * buffer in which every producer thread gets its own single-producer/
+ * single-consumer lane (a ring like Hal_RingBuffer) the first time it
+ * pushes, so producers never share a lock or write a shared cache line,
+ * and the one consumer combines the lanes:
+ *
+ * - RoundRobin takes from the lanes in turn, in popBatch a lane gives up to
+ *   an equal share of the batch before the next lane's turn.
+ * - Timestamp takes the item with the earliest push time among the heads of
+ *   the lanes, so the items of different producers come out roughly in the
+ *   order they were pushed.
+ *
+ * A producer only takes the mutex to park when its lane is full, and the
+ * consumer only to park when every lane is empty (after spinning as its
+ * Hal_WaitStrategy says) and to wake up parked producers. The push count of
+ * the metrics is brought up to date by the consumer as it scans the lanes,
+ * rather than by the producers.
+ *
+ * Exactly one thread may pop at a time (so a Hal_Pipe over it has one
+ * worker), and at most MaxLanes threads may ever push.
+ */
+
+#ifndef HAL_SHARDED_BUFFER_HPP_HAVE_SEEN
+
+#define HAL_SHARDED_BUFFER_HPP_HAVE_SEEN
+
+#include "hal-metrics.hpp"
+#include "hal-proc.hpp"
+#include "hal-wait-strategy.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+enum class Hal_ShardOrder { RoundRobin, Timestamp };
+
+template <typename T, size_t LaneCapacity = 1024, size_t MaxLanes = 64>
+class Hal_ShardedBuffer {
+  static_assert(LaneCapacity > 0 && 0 == (LaneCapacity & (LaneCapacity - 1)),
+                "Hal_ShardedBuffer lane capacity must be a power of 2");
+
+  static constexpr size_t kCacheLineSize = 64;
+
+  struct Slot {
+    alignas(T) unsigned char data[sizeof(T)];
+  };
+
+  struct Lane {
+    Lane()
+        : slots{std::make_unique<Slot[]>(LaneCapacity)},
+          pushTimes{std::make_unique<uint64_t[]>(LaneCapacity)} {}
+
+    ~Lane() {
+      size_t end = tail.load(std::memory_order_relaxed);
+
+      for (size_t index = head.load(std::memory_order_relaxed); index != end;
+           ++index) {
+        slot(index)->~T();
+      }
+    }
+
+    T *slot(size_t index) {
+      return std::launder(
+          reinterpret_cast<T *>(slots[index & (LaneCapacity - 1)].data));
+    }
+
+    // written by the consumer
+    alignas(kCacheLineSize) std::atomic<size_t> head{};
+    size_t seenTail{}; // the tail of the last scan, for the push count
+
+    // written by the producer
+    alignas(kCacheLineSize) std::atomic<size_t> tail{};
+
+    std::unique_ptr<Slot[]> slots{};
+    std::unique_ptr<uint64_t[]> pushTimes{};
+  };
+
+public:
+  // a Hal_Pipe over it refuses more than one worker
+  static constexpr bool kSingleConsumer = true;
+
+  Hal_ShardedBuffer(Hal_ShardOrder order = Hal_ShardOrder::RoundRobin,
+                    Hal_WaitStrategy waitStrategy = {})
+      : m_order{order}, m_waitStrategy{waitStrategy} {
+    int err{};
+
+    err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_popCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_pushCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_emptyCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  virtual ~Hal_ShardedBuffer() {
+    pthread_cond_destroy(&m_emptyCond);
+    pthread_cond_destroy(&m_pushCond);
+    pthread_cond_destroy(&m_popCond);
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  Hal_ShardedBuffer(const Hal_ShardedBuffer &halShardedBuffer) = delete;
+  const Hal_ShardedBuffer &
+  operator=(const Hal_ShardedBuffer &halShardedBuffer) = delete;
+  Hal_ShardedBuffer(Hal_ShardedBuffer &&halShardedBuffer) = delete;
+  Hal_ShardedBuffer &operator=(Hal_ShardedBuffer &&halShardedBuffer) = delete;
+
+  // moves from rItem if T's move constructor does not throw, copies it
+  // otherwise.
+  void push(T &rItem) { emplace(std::move_if_noexcept(rItem)); }
+
+  void push(T &&item) { emplace(std::move(item)); }
+
+  /**
+   * Constructs the item in place in the next free slot of the lane of the
+   * calling thread.
+   */
+  template <typename... Args> void emplace(Args &&...args) {
+    Lane &lane = getLane();
+    size_t tail = lane.tail.load(std::memory_order_relaxed);
+    uint64_t pushTime = isStamped() ? Hal_Metrics::now() : 0;
+
+    if (tail - lane.head.load(std::memory_order_acquire) >= LaneCapacity) {
+      waitForCapacity(lane, tail);
+
+      pushTime = blocked(pushTime);
+    }
+
+    new (lane.slot(tail)) T(std::forward<Args>(args)...);
+
+    if (isStamped()) {
+      lane.pushTimes[tail & (LaneCapacity - 1)] = pushTime;
+    }
+
+    publishTail(lane, tail + 1);
+  }
+
+  template <typename InputIt> void pushBatch(InputIt first, InputIt last) {
+    if (first == last) {
+      return;
+    }
+
+    Lane &lane = getLane();
+    size_t tail = lane.tail.load(std::memory_order_relaxed);
+    uint64_t pushTime = isStamped() ? Hal_Metrics::now() : 0;
+
+    while (first != last) {
+      if (tail - lane.head.load(std::memory_order_acquire) >= LaneCapacity) {
+        waitForCapacity(lane, tail);
+
+        pushTime = blocked(pushTime);
+      }
+
+      // fill all free slots of the lane before publishing the new tail
+      size_t head = lane.head.load(std::memory_order_acquire);
+      bool stamped = isStamped();
+      for (; first != last && tail - head < LaneCapacity; ++first, ++tail) {
+        new (lane.slot(tail)) T(std::move_if_noexcept(*first));
+
+        if (stamped) {
+          lane.pushTimes[tail & (LaneCapacity - 1)] = pushTime;
+        }
+      }
+
+      publishTail(lane, tail);
+    }
+  }
+
+  long long waitForEmpty() {
+    park(m_emptyCond, m_emptyParked, [this]() { return !hasItem(); });
+
+    long long count{};
+    size_t lanes = m_laneCount.load(std::memory_order_acquire);
+
+    for (size_t i = 0; i < lanes; i++) {
+      count += m_lanes[i]->head.load(std::memory_order_acquire);
+    }
+
+    return count;
+  }
+
+  T pop() {
+    Lane &lane = waitForLane();
+    size_t head = lane.head.load(std::memory_order_relaxed);
+
+    T *pItem = lane.slot(head);
+    T val = std::move(*pItem);
+    pItem->~T();
+
+    if (m_metrics.isRecording()) {
+      m_metrics.dequeued(lane.pushTimes[head & (LaneCapacity - 1)],
+                         Hal_Metrics::now());
+    }
+
+    m_metrics.popped(1);
+
+    publishHead(lane, head + 1);
+
+    return val;
+  }
+
+  std::vector<T> popBatch(size_t maxItems) {
+    std::vector<T> items{};
+
+    assert(maxItems > 0);
+
+    Lane *lane = &waitForLane();
+    uint64_t popTime = m_metrics.stamp();
+
+    // in timestamp order every item is a new choice of lane
+    size_t share = 1;
+    if (Hal_ShardOrder::RoundRobin == getOrder()) {
+      share = std::max<size_t>(
+          1, maxItems / m_laneCount.load(std::memory_order_acquire));
+    }
+
+    do {
+      take(*lane, std::min(share, maxItems - items.size()), items, popTime);
+    } while (items.size() < maxItems && nullptr != (lane = nextLane()));
+
+    m_metrics.popped(items.size());
+
+    return items;
+  }
+
+  Hal_Metrics &metrics() { return m_metrics; }
+
+  Hal_ShardOrder getOrder() const {
+    return m_order.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Takes effect at the next pop.
+   */
+  void setOrder(Hal_ShardOrder order) {
+    m_order.store(order, std::memory_order_relaxed);
+  }
+
+  Hal_WaitStrategy getWaitStrategy() const {
+    return m_waitStrategy.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Takes effect at the next wait of the consumer.
+   */
+  void setWaitStrategy(Hal_WaitStrategy waitStrategy) {
+    m_waitStrategy.store(waitStrategy, std::memory_order_relaxed);
+  }
+
+private:
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> id{};
+
+    return ++id;
+  }
+
+  struct LaneRef {
+    std::weak_ptr<void> buffer{};
+    Lane *lane{};
+  };
+
+  // the lane of the calling thread, it is looked up in a thread local map
+  // (by the id of the buffer, as an address may be reused by a later
+  // buffer) and only takes the mutex at the first push of the thread.
+  Lane &getLane() {
+    static thread_local std::unordered_map<uint64_t, LaneRef> t_lanes{};
+
+    auto iter = t_lanes.find(m_id);
+    if (iter != t_lanes.end()) {
+      return *iter->second.lane;
+    }
+
+    // the map only grows here, so the entries of the buffers destroyed since
+    // are dropped first, and a thread that pushes to many short lived
+    // buffers keeps only those alive.
+    for (iter = t_lanes.begin(); iter != t_lanes.end();) {
+      if (iter->second.buffer.expired()) {
+        iter = t_lanes.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+
+    Lane *lane = addLane();
+
+    t_lanes.emplace(m_id, LaneRef{m_alive, lane});
+
+    return *lane;
+  }
+
+  Lane *addLane() {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    // a thread id is only reused after the thread is gone, and then its
+    // lane can be taken over.
+    Lane *&lane = m_owners[std::this_thread::get_id()];
+
+    if (nullptr == lane) {
+      size_t count = m_laneCount.load(std::memory_order_relaxed);
+
+      if (count >= MaxLanes) {
+        m_owners.erase(std::this_thread::get_id());
+        pthread_mutex_unlock(&m_mutex);
+
+        throw std::length_error("Hal_ShardedBuffer has no lane left");
+      }
+
+      m_lanes[count] = std::make_unique<Lane>();
+      lane = m_lanes[count].get();
+
+      m_laneCount.store(count + 1, std::memory_order_release);
+    }
+
+    Lane *pLane = lane;
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    return pLane;
+  }
+
+  // records the time a push is blocked for, and returns the time it ends as
+  // the push time of the item.
+  uint64_t blocked(uint64_t waitTime) {
+    if (!isStamped()) {
+      return waitTime;
+    }
+
+    uint64_t now = Hal_Metrics::now();
+
+    m_metrics.blocked(now - waitTime);
+
+    return now;
+  }
+
+  // the push times are kept for the metrics and for the Timestamp order
+  bool isStamped() const {
+    return m_metrics.isRecording() || Hal_ShardOrder::Timestamp == getOrder();
+  }
+
+  void waitForCapacity(Lane &lane, size_t tail) {
+    park(m_pushCond, m_pushParked, [&lane, tail]() {
+      return tail - lane.head.load(std::memory_order_seq_cst) < LaneCapacity;
+    });
+  }
+
+  bool hasItem() const {
+    size_t lanes = m_laneCount.load(std::memory_order_acquire);
+
+    for (size_t i = 0; i < lanes; i++) {
+      if (m_lanes[i]->head.load(std::memory_order_seq_cst) !=
+          m_lanes[i]->tail.load(std::memory_order_seq_cst)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // the lane to take from next, or nullptr if all lanes are empty, the scan
+  // also counts the items pushed since the last scan.
+  Lane *nextLane() {
+    size_t lanes = m_laneCount.load(std::memory_order_acquire);
+    bool roundRobin = Hal_ShardOrder::RoundRobin == getOrder();
+    Lane *next{};
+    uint64_t nextPushTime{};
+    uint64_t pushed{};
+    uint64_t depth{};
+
+    for (size_t i = 0; i < lanes; i++) {
+      size_t index = (m_next + i) % lanes;
+      Lane *lane = m_lanes[index].get();
+      size_t head = lane->head.load(std::memory_order_relaxed);
+      size_t tail = lane->tail.load(std::memory_order_acquire);
+
+      pushed += tail - lane->seenTail;
+      lane->seenTail = tail;
+      depth += tail - head;
+
+      if (head == tail) {
+        continue;
+      }
+
+      if (roundRobin) {
+        if (nullptr == next) {
+          next = lane;
+          m_next = index + 1;
+        }
+
+        continue;
+      }
+
+      uint64_t pushTime = lane->pushTimes[head & (LaneCapacity - 1)];
+
+      if (nullptr == next || pushTime < nextPushTime) {
+        next = lane;
+        nextPushTime = pushTime;
+      }
+    }
+
+    if (pushed > 0) {
+      m_metrics.pushed(pushed, depth);
+    }
+
+    return next;
+  }
+
+  Lane &waitForLane() {
+    Lane *lane{};
+    auto ready = [this]() { return hasItem(); };
+
+    while (nullptr == (lane = nextLane())) {
+      Hal_WaitStrategy waitStrategy = getWaitStrategy();
+
+      if (!waitStrategy.spin(ready)) {
+        park(m_popCond, m_popParked, ready);
+      }
+    }
+
+    return *lane;
+  }
+
+  void take(Lane &lane, size_t maxItems, std::vector<T> &items,
+            uint64_t popTime) {
+    size_t head = lane.head.load(std::memory_order_relaxed);
+    size_t end =
+        head + std::min(maxItems,
+                        lane.tail.load(std::memory_order_acquire) - head);
+
+    for (; head != end; ++head) {
+      T *pItem = lane.slot(head);
+      items.push_back(std::move(*pItem));
+      pItem->~T();
+
+      if (m_metrics.isRecording()) {
+        m_metrics.dequeued(lane.pushTimes[head & (LaneCapacity - 1)],
+                           popTime);
+      }
+    }
+
+    publishHead(lane, head);
+  }
+
+  void publishTail(Lane &lane, size_t tail) {
+    lane.tail.store(tail, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_popParked.load(std::memory_order_relaxed) > 0) {
+      wake(m_popCond, false);
+    }
+  }
+
+  void publishHead(Lane &lane, size_t head) {
+    lane.head.store(head, std::memory_order_release);
+
+    // producers of different lanes park on the same condition variable, so
+    // they are all woken up to re-check their own lane.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_pushParked.load(std::memory_order_relaxed) > 0) {
+      wake(m_pushCond, true);
+    }
+
+    if (m_emptyParked.load(std::memory_order_relaxed) > 0) {
+      wake(m_emptyCond, true);
+    }
+  }
+
+  template <typename Predicate>
+  void park(pthread_cond_t &cond, std::atomic<int> &parked, Predicate pred) {
+    int err{};
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    // announce ourself before re-checking the predicate, the other side
+    // publishes its counter before checking the parked count, so one of us
+    // always sees the other.
+    parked.fetch_add(1, std::memory_order_seq_cst);
+
+    while (!pred()) {
+      try {
+        err = Hal_Proc::condWait(&cond, &m_mutex);
+      } catch (const Hal_StopException &) {
+        parked.fetch_sub(1, std::memory_order_relaxed);
+
+        throw;
+      }
+
+      if (err) {
+        parked.fetch_sub(1, std::memory_order_relaxed);
+
+        throw std::runtime_error(strerror(err));
+      }
+
+      m_metrics.woken();
+    }
+
+    parked.fetch_sub(1, std::memory_order_relaxed);
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  void wake(pthread_cond_t &cond, bool all) {
+    int err{};
+
+    err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = all ? pthread_cond_broadcast(&cond) : pthread_cond_signal(&cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  const uint64_t m_id{nextId()};
+
+  // expires with the buffer, for the thread local maps of the lanes
+  const std::shared_ptr<void> m_alive{std::make_shared<char>()};
+
+  // the lanes are only appended (under m_mutex) and never moved, the
+  // consumer reads the first m_laneCount of them without the mutex.
+  std::unique_ptr<Lane> m_lanes[MaxLanes]{};
+  std::atomic<size_t> m_laneCount{};
+  std::unordered_map<std::thread::id, Lane *> m_owners{};
+
+  // read by every producer, but only written when a thread parks
+  alignas(kCacheLineSize) std::atomic<int> m_popParked{};
+  std::atomic<int> m_pushParked{};
+  std::atomic<int> m_emptyParked{};
+
+  // the consumer side
+  alignas(kCacheLineSize) size_t m_next{}; // round robin cursor
+  std::atomic<Hal_ShardOrder> m_order{};
+  std::atomic<Hal_WaitStrategy> m_waitStrategy{};
+  Hal_Metrics m_metrics{};
+
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_popCond{};
+  pthread_cond_t m_pushCond{};
+  pthread_cond_t m_emptyCond{};
+};
+
+#endif /* HAL_SHARDED_BUFFER_HPP_HAVE_SEEN */
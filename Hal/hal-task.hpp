@@ -0,0 +1,156 @@
+/**
+ * This module implements Hal_Task, a move-only replacement of std::function
+ * that stores the callable inline in InlineSize bytes of the task object if
+ * it fits (and is nothrow movable), so that creating and moving typical
+ * closures (a this pointer plus a few captured values) never allocates. A
+ * larger callable is moved to the heap like std::function does.
+ *
+ * Being move-only, it can also hold closures capturing move-only objects
+ * (e.g. std::unique_ptr) which std::function can not.
+ */
+
+#ifndef HAL_TASK_HPP_HAVE_SEEN
+
+#define HAL_TASK_HPP_HAVE_SEEN
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <typename Signature, size_t InlineSize = 64> class Hal_Task;
+
+template <typename R, typename... Args, size_t InlineSize>
+class Hal_Task<R(Args...), InlineSize> {
+  static_assert(InlineSize >= sizeof(void *),
+                "Hal_Task inline storage must at least hold a pointer");
+
+  struct Ops {
+    R (*invoke)(void *storage, Args &&...args);
+    void (*move)(void *src, void *dst) noexcept;
+    void (*destroy)(void *storage) noexcept;
+  };
+
+  template <typename Fn>
+  static constexpr bool isInline =
+      sizeof(Fn) <= InlineSize && alignof(Fn) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<Fn>;
+
+  template <typename Fn> struct IsStdFunction : std::false_type {};
+
+  template <typename Sig>
+  struct IsStdFunction<std::function<Sig>> : std::true_type {};
+
+public:
+  Hal_Task() noexcept = default;
+  Hal_Task(std::nullptr_t) noexcept {}
+
+  template <typename Fn, typename Functor = std::decay_t<Fn>,
+            typename = std::enable_if_t<
+                !std::is_same_v<Functor, Hal_Task> &&
+                std::is_invocable_r_v<R, Functor &, Args...>>>
+  Hal_Task(Fn &&fn) {
+    // an empty std::function or null function pointer is an empty task
+    if constexpr (std::is_pointer_v<Functor> ||
+                  IsStdFunction<Functor>::value) {
+      if (!fn) {
+        return;
+      }
+    }
+
+    if constexpr (isInline<Functor>) {
+      new (m_storage) Functor(std::forward<Fn>(fn));
+      m_ops = &kInlineOps<Functor>;
+    } else {
+      *reinterpret_cast<Functor **>(m_storage) =
+          new Functor(std::forward<Fn>(fn));
+      m_ops = &kHeapOps<Functor>;
+    }
+  }
+
+  Hal_Task(Hal_Task &&halTask) noexcept { moveFrom(halTask); }
+
+  Hal_Task &operator=(Hal_Task &&halTask) noexcept {
+    if (this != &halTask) {
+      reset();
+      moveFrom(halTask);
+    }
+
+    return *this;
+  }
+
+  Hal_Task &operator=(std::nullptr_t) noexcept {
+    reset();
+
+    return *this;
+  }
+
+  ~Hal_Task() { reset(); }
+
+  Hal_Task(const Hal_Task &halTask) = delete;
+  const Hal_Task &operator=(const Hal_Task &halTask) = delete;
+
+  explicit operator bool() const noexcept { return nullptr != m_ops; }
+
+  R operator()(Args... args) const {
+    if (nullptr == m_ops) {
+      throw std::bad_function_call();
+    }
+
+    return m_ops->invoke(const_cast<unsigned char *>(m_storage),
+                         std::forward<Args>(args)...);
+  }
+
+private:
+  void moveFrom(Hal_Task &halTask) noexcept {
+    if (halTask.m_ops) {
+      halTask.m_ops->move(halTask.m_storage, m_storage);
+      m_ops = halTask.m_ops;
+      halTask.m_ops = nullptr;
+    }
+  }
+
+  void reset() noexcept {
+    if (m_ops) {
+      m_ops->destroy(m_storage);
+      m_ops = nullptr;
+    }
+  }
+
+  template <typename Fn> static Fn *inlineFn(void *storage) {
+    return std::launder(reinterpret_cast<Fn *>(storage));
+  }
+
+  template <typename Fn> static Fn *heapFn(void *storage) {
+    return *reinterpret_cast<Fn **>(storage);
+  }
+
+  template <typename Fn>
+  static constexpr Ops kInlineOps{
+      [](void *storage, Args &&...args) -> R {
+        return std::invoke(*inlineFn<Fn>(storage),
+                           std::forward<Args>(args)...);
+      },
+      [](void *src, void *dst) noexcept {
+        new (dst) Fn(std::move(*inlineFn<Fn>(src)));
+        inlineFn<Fn>(src)->~Fn();
+      },
+      [](void *storage) noexcept { inlineFn<Fn>(storage)->~Fn(); }};
+
+  template <typename Fn>
+  static constexpr Ops kHeapOps{
+      [](void *storage, Args &&...args) -> R {
+        return std::invoke(*heapFn<Fn>(storage),
+                           std::forward<Args>(args)...);
+      },
+      [](void *src, void *dst) noexcept {
+        *reinterpret_cast<Fn **>(dst) = heapFn<Fn>(src);
+      },
+      [](void *storage) noexcept { delete heapFn<Fn>(storage); }};
+
+  alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+  const Ops *m_ops{};
+};
+
+#endif /* HAL_TASK_HPP_HAVE_SEEN */
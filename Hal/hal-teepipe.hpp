@@ -3,90 +3,236 @@
 #define HAL_TEEPIPE_HPP_HAVE_SEEN
 
 #include "hal-limit-buffer.hpp"
+#include "hal-metrics.hpp"
 #include "hal-pipe.hpp"
 #include "hal-proc.hpp"
 
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string_view>
 #include <thread>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
+/**
+ * Hal_TeePipe merges the items written to any number of Hal_TeePipeSource
+ * into one Hal_Pipe, a conveyor thread moves the items from the sources to
+ * the pipe in one of two modes:
+ *
+ * - lock step (default), the conveyor waits until every open source has an
+ *   item, takes one item from each of them, passes the round to the post
+ *   processing function and writes the round to the pipe.
+ *
+ * - merge (constructed with a comparator), the conveyor keeps the head item
+ *   of every source in a heap and writes the smallest head to the pipe as
+ *   soon as no open source is empty. If every source is ordered, the pipe
+ *   output is ordered (a k-way merge), and a fast source does not have to
+ *   wait for a full round of the slower sources.
+ *
+ * An open source that has nothing to write can still let the conveyor move
+ * on by advancing its watermark, and with an idle timeout set, the conveyor
+ * stops waiting for a source that has gone quiet.
+ *
+ * Removing a source does not drop its pending items, but the conveyor no
+ * longer waits for it once it runs out of items, so that the items of the
+ * other sources still drain (in merge mode a source should be removed once
+ * it has nothing more to write, e.g. at end of input).
+ */
 template <typename T> class Hal_TeePipe : private Hal_Pipe<T> {
   using Task = std::function<void(T)>;
   using PostProcessingTask = std::function<void(std::vector<T> &)>;
+  using MergeCompare = std::function<bool(const T &, const T &)>;
+  using Clock = std::chrono::steady_clock;
 
   class Hal_TeePipeSource : private Hal_LimitBuffer<T> {
     friend class Hal_TeePipe<T>;
 
   public:
-    Hal_TeePipeSource(size_t capacity, Hal_TeePipe *tp)
-        : Hal_LimitBuffer<T>{capacity}, m_teePipe(tp) {}
+    Hal_TeePipeSource(size_t capacity, size_t highWaterMark, Hal_TeePipe *tp)
+        : Hal_LimitBuffer<T>{capacity}, m_teePipe(tp),
+          m_highWaterMark{highWaterMark} {}
 
     ~Hal_TeePipeSource() = default;
 
-    void write(T &rItem) {
+    using Hal_LimitBuffer<T>::metrics;
+
+    void write(T &rItem) { emplace(std::move_if_noexcept(rItem)); }
+
+    void write(T &&item) { emplace(std::move(item)); }
+
+    template <typename... Args> void emplace(Args &&...args) {
+      assert(m_teePipe);
+
+      Hal_LimitBuffer<T>::emplace(std::forward<Args>(args)...);
+      pushed();
+    }
+
+    /**
+     * As write, but waits at most timeout for room in the source, and
+     * returns Hal_PushStatus::TimedOut (leaving rItem as is) if there is
+     * none, e.g. to write from a thread that must not block.
+     */
+    Hal_PushStatus writeFor(T &rItem, std::chrono::nanoseconds timeout) {
       assert(m_teePipe);
 
-      Hal_LimitBuffer<T>::push(rItem);
+      Hal_PushStatus status = Hal_LimitBuffer<T>::pushFor(rItem, timeout);
+      if (Hal_PushStatus::TimedOut != status) {
+        pushed();
+      }
+
+      return status;
+    }
+
+    Hal_PushStatus writeFor(T &&item, std::chrono::nanoseconds timeout) {
+      return writeFor(item, timeout);
+    }
+
+    /**
+     * Tells the conveyor that the source is alive but has nothing to write,
+     * in merge mode the source promises that its next item does not go
+     * before watermark, so the conveyor can move the items of the other
+     * sources up to watermark without waiting for it. In lock step mode, the
+     * conveyor moves rounds without the source until its next item.
+     */
+    void advanceWatermark(const T &watermark) {
+      assert(m_teePipe);
 
       int err = pthread_mutex_lock(&(m_teePipe->m_mutex));
       if (err) {
         throw std::runtime_error(strerror(err));
       }
 
-      pthread_testcancel();
-      m_teePipe->m_fillBufferCount++;
+      if (!m_watermark || !m_teePipe->m_mergeCompare ||
+          m_teePipe->m_mergeCompare(*m_watermark, watermark)) {
+        m_watermark = watermark;
+      }
 
-      err = pthread_cond_signal(&(m_teePipe->m_cond));
+      m_lastActive = Clock::now();
+
+      if (m_teePipe->m_conveyorParked) {
+        err = pthread_cond_broadcast(&(m_teePipe->m_cond));
+        if (err) {
+          pthread_mutex_unlock(&(m_teePipe->m_mutex));
+
+          throw std::runtime_error(strerror(err));
+        }
+      }
+
+      err = pthread_mutex_unlock(&(m_teePipe->m_mutex));
       if (err) {
-        pthread_mutex_unlock(&(m_teePipe->m_mutex));
+        throw std::runtime_error(strerror(err));
+      }
+    }
 
+  private:
+    // after an item is pushed to the source
+    void pushed() {
+      int err = pthread_mutex_lock(&(m_teePipe->m_mutex));
+      if (err) {
         throw std::runtime_error(strerror(err));
       }
 
+      m_teePipe->m_fillBufferCount++;
+      m_count++;
+      m_lastActive = Clock::now();
+      updateEmpty();
+
+      // in lock step mode, a watermark only lets the conveyor skip the source
+      // until the source has an item again.
+      if (!m_teePipe->m_mergeCompare) {
+        m_watermark.reset();
+      }
+
+      // the parked conveyor is waiting for an empty source, so there is no
+      // point to wake it up for every item of a non-empty source.
+      if (m_teePipe->m_conveyorParked &&
+          (1 == m_count || m_count >= m_highWaterMark)) {
+        err = pthread_cond_broadcast(&(m_teePipe->m_cond));
+        if (err) {
+          pthread_mutex_unlock(&(m_teePipe->m_mutex));
+
+          throw std::runtime_error(strerror(err));
+        }
+      }
+
       err = pthread_mutex_unlock(&(m_teePipe->m_mutex));
       if (err) {
         throw std::runtime_error(strerror(err));
       }
     }
 
-  private:
-    T read() { return Hal_LimitBuffer<T>::pop(); }
+    T read() {
+      m_count--;
 
-    Hal_TeePipe *m_teePipe{};
-  };
+      return Hal_LimitBuffer<T>::pop();
+    }
 
-public:
-  Hal_TeePipe(std::string_view name, Hal_TeePipe::Task fn = {},
-              Hal_TeePipe::PostProcessingTask pfn = {})
-      : Hal_Pipe<T>{name, fn},
-        m_conveyor{std::make_unique<Hal_Proc>(std::string(name) + "-conveyor")},
-        m_postProcessingTaskFn{pfn} {
-    int err{};
+    std::vector<T> readBatch(size_t maxItems) {
+      std::vector<T> items = Hal_LimitBuffer<T>::popBatch(maxItems);
 
-    err = pthread_mutex_init(&m_mutex, NULL);
-    if (err) {
-      throw std::runtime_error(strerror(err));
+      m_count -= items.size();
+      updateEmpty();
+
+      return items;
     }
 
-    err = pthread_cond_init(&m_cond, NULL);
-    if (err) {
-      throw std::runtime_error(strerror(err));
+    // keeps the count of open sources without items of the Hal_TeePipe, so
+    // that the conveyor does not look for them while there is none.
+    void updateEmpty() {
+      bool empty = !m_closed && 0 == m_count && !m_head;
+
+      if (empty != m_empty) {
+        m_empty = empty;
+
+        if (empty) {
+          m_teePipe->m_emptySources++;
+        } else {
+          m_teePipe->m_emptySources--;
+        }
+      }
     }
 
-    err = pthread_cond_init(&m_emptyCond, NULL);
-    if (err) {
-      throw std::runtime_error(strerror(err));
+    bool isIdle(Clock::time_point now) const {
+      return m_teePipe->m_idleTimeout.count() > 0 &&
+             now - m_lastActive >= m_teePipe->m_idleTimeout;
     }
 
-    runConveyorExec();
-  }
+    // lock step mode, the conveyor waits for an item of the source
+    bool isRequired(Clock::time_point now) const {
+      return !m_closed && !m_watermark && !isIdle(now);
+    }
+
+    Hal_TeePipe *m_teePipe{};
+    const size_t m_highWaterMark{};
+
+    // below are guarded by the Hal_TeePipe mutex
+    size_t m_count{};
+    bool m_closed{};
+    bool m_empty{}; // counted in the Hal_TeePipe m_emptySources
+    std::optional<T> m_head{};
+    std::optional<T> m_watermark{};
+    Clock::time_point m_lastActive{Clock::now()};
+  };
+
+public:
+  Hal_TeePipe(std::string_view name, Hal_TeePipe::Task fn = {},
+              Hal_TeePipe::PostProcessingTask pfn = {})
+      : Hal_TeePipe{name, fn, pfn, {}} {}
+
+  /**
+   * Merge mode, cmp(a, b) returns true if item a goes before item b.
+   */
+  Hal_TeePipe(std::string_view name, Hal_TeePipe::Task fn,
+              Hal_TeePipe::MergeCompare cmp)
+      : Hal_TeePipe{name, fn, {}, cmp} {}
 
   virtual ~Hal_TeePipe() noexcept try {
     // this is important as the conveyor thread uses the conditional variable
@@ -96,6 +242,10 @@ public:
     // system wide leak of available thread resource.
     m_conveyor = {};
 
+    for (auto &sp_tps : m_buffers) {
+      Hal_MetricsRegistry::getDefault().remove(&sp_tps->metrics());
+    }
+
     pthread_cond_destroy(&m_cond);
     pthread_cond_destroy(&m_emptyCond);
     pthread_mutex_destroy(&m_mutex);
@@ -109,20 +259,34 @@ public:
   Hal_TeePipe(const Hal_TeePipe<T> &&halTeePipe) = delete;
   Hal_TeePipe<T> &operator=(Hal_TeePipe<T> &&halTeePipe) = delete;
 
-  std::shared_ptr<Hal_TeePipeSource> addHal_TeePipeSource() {
+  /**
+   * A source holds up to capacity items before its writer blocks, and its
+   * writer wakes up the conveyor when the source turns non-empty or holds
+   * highWaterMark items (capacity if 0), so that the conveyor takes items
+   * in bulk rather than one at a time.
+   */
+  std::shared_ptr<Hal_TeePipeSource>
+  addHal_TeePipeSource(size_t capacity = 1, size_t highWaterMark = 0) {
+    if (0 == highWaterMark) {
+      highWaterMark = capacity;
+    }
+
+    assert(highWaterMark <= capacity);
+
     std::shared_ptr<Hal_TeePipeSource> sp_tpSource{
-        std::make_shared<Hal_TeePipeSource>(1, this)};
+        std::make_shared<Hal_TeePipeSource>(capacity, highWaterMark, this)};
 
     int err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
-
     m_buffers.push_back(sp_tpSource);
+    sp_tpSource->updateEmpty();
+    Hal_MetricsRegistry::getDefault().add(this->getName() + "-source",
+                                          &sp_tpSource->metrics());
 
-    err = pthread_cond_signal(&m_cond);
+    err = pthread_cond_broadcast(&m_cond);
     if (err) {
       pthread_mutex_unlock(&m_mutex);
 
@@ -146,29 +310,49 @@ public:
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
-
     auto iter =
         std::find_if(m_buffers.begin(), m_buffers.end(),
                      [sp_tps](std::shared_ptr<Hal_TeePipeSource> sp_iterTps) {
                        return sp_tps.get() == sp_iterTps.get();
                      });
 
+    // a closed source no longer holds back the conveyor, and the conveyor
+    // drops it once its remaining items are moved to the pipe.
     if (iter != m_buffers.end()) {
-      while (sp_tps->size() > 0) {
-        err = pthread_cond_wait(&m_emptyCond, &m_mutex);
-        if (err) {
-          throw std::runtime_error(strerror(err));
-        }
+      sp_tps->m_closed = true;
+      sp_tps->updateEmpty();
+      sp_tps = {};
+    }
 
-        pthread_testcancel();
-      }
+    err = pthread_cond_broadcast(&m_cond);
+    if (err) {
+      pthread_mutex_unlock(&m_mutex);
 
-      m_buffers.erase(iter);
-      sp_tps = {};
+      throw std::runtime_error(strerror(err));
     }
 
-    err = pthread_cond_signal(&m_cond);
+    err = pthread_mutex_unlock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  /**
+   * The conveyor no longer waits for an open source that has neither
+   * written an item nor advanced its watermark for timeout (0, the default,
+   * waits forever), so one quiet source does not stall the others. Items
+   * the source writes afterward are moved as they come, in merge mode they
+   * may be out of order with what is already moved.
+   */
+  void setIdleTimeout(std::chrono::milliseconds timeout) {
+    int err = pthread_mutex_lock(&m_mutex);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    m_idleTimeout = timeout;
+
+    err = pthread_cond_broadcast(&m_cond);
     if (err) {
       pthread_mutex_unlock(&m_mutex);
 
@@ -186,35 +370,72 @@ public:
   void waitForEmpty() { wait(false); }
 
 private:
+  Hal_TeePipe(std::string_view name, Hal_TeePipe::Task fn,
+              Hal_TeePipe::PostProcessingTask pfn,
+              Hal_TeePipe::MergeCompare cmp)
+      : Hal_Pipe<T>{name, fn},
+        m_conveyor{std::make_unique<Hal_Proc>(std::string(name) + "-conveyor")},
+        m_postProcessingTaskFn{pfn}, m_mergeCompare{cmp} {
+    int err{};
+
+    err = pthread_mutex_init(&m_mutex, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    // the conveyor waits for an idle source deadline of the steady clock,
+    // which is CLOCK_MONOTONIC.
+    pthread_condattr_t condAttr{};
+
+    err = pthread_condattr_init(&condAttr);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    if (err) {
+      pthread_condattr_destroy(&condAttr);
+
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_cond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    err = pthread_cond_init(&m_emptyCond, NULL);
+    if (err) {
+      throw std::runtime_error(strerror(err));
+    }
+
+    runConveyorExec();
+  }
+
   void wait(bool noOpenSource) {
     int err = pthread_mutex_lock(&m_mutex);
     if (err) {
       throw std::runtime_error(strerror(err));
     }
 
-    pthread_testcancel();
-
     // only returns if no other object owns the Hal_TeePipeSource than
     // Hal_TeePipe
     while (noOpenSource && m_buffers.size() > 0 &&
            std::count_if(m_buffers.begin(), m_buffers.end(),
                          [](auto &item) { return item.use_count() > 1; }) > 0) {
-      err = pthread_cond_wait(&m_cond, &m_mutex);
+      err = Hal_Proc::condWait(&m_cond, &m_mutex);
       if (err) {
         throw std::runtime_error(strerror(err));
       }
-
-      pthread_testcancel();
     }
 
     // only returns if no data in buffer from Hal_TeePipeSource to conveyor
     while (m_fillBufferCount > 0) {
-      err = pthread_cond_wait(&m_emptyCond, &m_mutex);
+      err = Hal_Proc::condWait(&m_emptyCond, &m_mutex);
       if (err) {
         throw std::runtime_error(strerror(err));
       }
-
-      pthread_testcancel();
     }
 
     err = pthread_mutex_unlock(&m_mutex);
@@ -225,49 +446,67 @@ private:
     Hal_Pipe<T>::waitForEmpty();
   }
 
-  void write(T &rItem) { Hal_Pipe<T>::write(rItem); }
-
   void runConveyorExec() {
     m_conveyor->exec([this]() {
-      while (true) {
+      while (!Hal_Proc::stopRequested()) {
         int err{};
 
+        std::vector<T> items{};
+
         err = pthread_mutex_lock(&m_mutex);
         if (err) {
           throw std::runtime_error(strerror(err));
         }
 
-        pthread_testcancel();
+        while (!(m_mergeCompare ? mergeItems(items) : moveRounds(items)) &&
+               !dropClosedSources()) {
+          std::optional<Clock::time_point> deadline = idleDeadline();
+
+          m_conveyorParked = true;
+
+          if (deadline) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          deadline->time_since_epoch())
+                          .count();
+            struct timespec ts{};
+
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+
+            err = Hal_Proc::condTimedWait(&m_cond, &m_mutex, &ts);
+            if (ETIMEDOUT == err) {
+              err = 0;
+            }
+          } else {
+            err = Hal_Proc::condWait(&m_cond, &m_mutex);
+          }
 
-        while (m_buffers.empty() || m_fillBufferCount < m_buffers.size()) {
-          err = pthread_cond_wait(&m_cond, &m_mutex);
+          m_conveyorParked = false;
           if (err) {
             throw std::runtime_error(strerror(err));
           }
-
-          pthread_testcancel();
         }
 
-        std::vector<T> postProcessingBuffers{};
-
-        for (auto sp_tps : m_buffers) {
-          m_fillBufferCount--;
-
-          T data = sp_tps->read();
-          postProcessingBuffers.push_back(std::move_if_noexcept(data));
+        err = pthread_mutex_unlock(&m_mutex);
+        if (err) {
+          throw std::runtime_error(strerror(err));
         }
 
-        if (m_postProcessingTaskFn != nullptr) {
-          m_postProcessingTaskFn(postProcessingBuffers);
+        // the pipe is written without the mutex, so the writers of the
+        // sources are not held up by it, and the items are counted as moved
+        // only once they are in the pipe, which wait() relies on.
+        if (!items.empty()) {
+          Hal_Pipe<T>::writeBatch(items.begin(), items.end());
         }
 
-        for (auto &data : postProcessingBuffers) {
-          write(data);
+        err = pthread_mutex_lock(&m_mutex);
+        if (err) {
+          throw std::runtime_error(strerror(err));
         }
 
-        postProcessingBuffers.clear();
+        m_fillBufferCount -= items.size();
 
-        err = pthread_cond_signal(&m_emptyCond);
+        err = pthread_cond_broadcast(&m_emptyCond);
         if (err) {
           pthread_mutex_unlock(&m_mutex);
 
@@ -282,13 +521,192 @@ private:
     });
   }
 
+  // lock step mode, moves as many rounds as the open sources have items
+  // for (any items of closed sources if none is open) to items, one batch
+  // read per source, returns false if nothing is moved.
+  bool moveRounds(std::vector<T> &items) {
+    Clock::time_point now = Clock::now();
+    size_t rounds{};
+    bool open{};
+
+    for (auto &sp_tps : m_buffers) {
+      if (!sp_tps->isRequired(now)) {
+        rounds = open ? rounds : std::max(rounds, sp_tps->m_count);
+      } else {
+        rounds = open ? std::min(rounds, sp_tps->m_count) : sp_tps->m_count;
+        open = true;
+      }
+    }
+
+    if (0 == rounds) {
+      return false;
+    }
+
+    std::vector<std::vector<T>> batches{};
+
+    for (auto &sp_tps : m_buffers) {
+      if (sp_tps->m_count > 0) {
+        batches.push_back(
+            sp_tps->readBatch(std::min(rounds, sp_tps->m_count)));
+      }
+    }
+
+    std::vector<T> postProcessingBuffers{};
+
+    for (size_t i = 0; i < rounds; i++) {
+      postProcessingBuffers.clear();
+
+      for (auto &batch : batches) {
+        if (i < batch.size()) {
+          postProcessingBuffers.push_back(std::move(batch[i]));
+        }
+      }
+
+      if (m_postProcessingTaskFn != nullptr) {
+        m_postProcessingTaskFn(postProcessingBuffers);
+      }
+
+      for (auto &data : postProcessingBuffers) {
+        items.push_back(std::move(data));
+      }
+    }
+
+    return true;
+  }
+
+  // merge mode, moves the smallest head item to items for as long as no open
+  // source is empty, returns false if nothing is moved.
+  bool mergeItems(std::vector<T> &items) {
+    for (auto &sp_tps : m_buffers) {
+      fillHead(sp_tps.get());
+    }
+
+    Clock::time_point now = Clock::now();
+
+    // an open empty source holds back the items after its watermark, or all
+    // of them without one, unless it is idle, so the items are moved up to
+    // the earliest such watermark (the barrier).
+    bool blocked{};
+    const T *barrier{};
+
+    auto holdBack = [this, now, &blocked,
+                     &barrier](const Hal_TeePipeSource *tps) {
+      if (tps->isIdle(now)) {
+        return;
+      }
+
+      if (!tps->m_watermark) {
+        blocked = true;
+      } else if (nullptr == barrier ||
+                 m_mergeCompare(*tps->m_watermark, *barrier)) {
+        barrier = &*tps->m_watermark;
+      }
+    };
+
+    if (m_emptySources > 0) {
+      for (auto &sp_tps : m_buffers) {
+        if (sp_tps->m_empty) {
+          holdBack(sp_tps.get());
+        }
+      }
+    }
+
+    while (!blocked && !m_mergeHeap.empty() &&
+           (nullptr == barrier ||
+            !m_mergeCompare(*barrier, *m_mergeHeap.front()->m_head))) {
+      std::pop_heap(m_mergeHeap.begin(), m_mergeHeap.end(),
+                    [this](Hal_TeePipeSource *lhs, Hal_TeePipeSource *rhs) {
+                      return m_mergeCompare(*rhs->m_head, *lhs->m_head);
+                    });
+
+      Hal_TeePipeSource *tps = m_mergeHeap.back();
+      m_mergeHeap.pop_back();
+
+      items.push_back(std::move(*tps->m_head));
+      tps->m_head.reset();
+
+      fillHead(tps);
+
+      // the source ran out of items with this one
+      if (tps->m_empty) {
+        holdBack(tps);
+      }
+    }
+
+    return !items.empty();
+  }
+
+  // the earliest time an open empty source turns idle, if idle timeout is on
+  std::optional<Clock::time_point> idleDeadline() const {
+    Clock::time_point now = Clock::now();
+    std::optional<Clock::time_point> deadline{};
+
+    if (m_idleTimeout.count() <= 0) {
+      return deadline;
+    }
+
+    for (auto &sp_tps : m_buffers) {
+      if (!sp_tps->m_closed && 0 == sp_tps->m_count && !sp_tps->m_head &&
+          !sp_tps->isIdle(now) && (m_mergeCompare || !sp_tps->m_watermark)) {
+        Clock::time_point idleAt = sp_tps->m_lastActive + m_idleTimeout;
+
+        if (!deadline || idleAt < *deadline) {
+          deadline = idleAt;
+        }
+      }
+    }
+
+    return deadline;
+  }
+
+  // returns true if any closed source without items left is dropped.
+  bool dropClosedSources() {
+    auto iter = std::remove_if(m_buffers.begin(), m_buffers.end(),
+                               [](auto &sp_tps) {
+                                 return sp_tps->m_closed &&
+                                        0 == sp_tps->m_count &&
+                                        !sp_tps->m_head;
+                               });
+    bool dropped = iter != m_buffers.end();
+
+    for (auto dropIter = iter; dropIter != m_buffers.end(); ++dropIter) {
+      Hal_MetricsRegistry::getDefault().remove(&(*dropIter)->metrics());
+    }
+
+    m_buffers.erase(iter, m_buffers.end());
+
+    return dropped;
+  }
+
+  void fillHead(Hal_TeePipeSource *tps) {
+    if (tps->m_head || 0 == tps->m_count) {
+      tps->updateEmpty();
+
+      return;
+    }
+
+    tps->m_head = tps->read();
+    tps->updateEmpty();
+
+    m_mergeHeap.push_back(tps);
+    std::push_heap(m_mergeHeap.begin(), m_mergeHeap.end(),
+                   [this](Hal_TeePipeSource *lhs, Hal_TeePipeSource *rhs) {
+                     return m_mergeCompare(*rhs->m_head, *lhs->m_head);
+                   });
+  }
+
   std::unique_ptr<Hal_Proc> m_conveyor{};
   pthread_mutex_t m_mutex{};
   pthread_cond_t m_cond{};
   pthread_cond_t m_emptyCond{};
   size_t m_fillBufferCount{};
+  size_t m_emptySources{};
+  bool m_conveyorParked{};
+  std::chrono::milliseconds m_idleTimeout{};
   std::vector<std::shared_ptr<Hal_TeePipeSource>> m_buffers{};
   Hal_TeePipe::PostProcessingTask m_postProcessingTaskFn{};
+  Hal_TeePipe::MergeCompare m_mergeCompare{};
+  std::vector<Hal_TeePipeSource *> m_mergeHeap{};
 };
 
 #endif /* HAL_TEEPIPE_HPP_HAVE_SEEN */
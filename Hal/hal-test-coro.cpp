@@ -0,0 +1,69 @@
+/**
+ * This is a test file for the coroutines of hal-coro.hpp, a chain of 1000
+ * stages connected by Hal_LimitBuffer runs as coroutines on an executor of
+ * 2 threads, each stage adds 1 to the items it passes on. The last stage
+ * asks a Hal_Async to sum the items, and -1 ends the chain.
+ */
+
+#include "hal-async.hpp"
+#include "hal-coro.hpp"
+#include "hal-executor.hpp"
+#include "hal-limit-buffer.hpp"
+#include "hal-pipe.hpp"
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+static Hal_CoTask<> stage(Hal_Pipe<int> &in, Hal_LimitBuffer<int> &out) {
+  for (int item = 0; item >= 0;) {
+    item = co_await Hal_CoRead(in);
+    co_await Hal_CoPush(out, item);
+  }
+}
+
+static Hal_CoTask<> stage(Hal_LimitBuffer<int> &in,
+                          Hal_LimitBuffer<int> &out) {
+  for (int item = 0; item >= 0;) {
+    item = co_await Hal_CoPop(in);
+    co_await Hal_CoPush(out, item >= 0 ? item + 1 : item);
+  }
+}
+
+static Hal_CoTask<long> sum(Hal_LimitBuffer<int> &in, Hal_Async &async) {
+  long total{};
+
+  for (int item = co_await Hal_CoPop(in); item >= 0;
+       item = co_await Hal_CoPop(in)) {
+    total = co_await async.call([total, item]() { return total + item; });
+  }
+
+  co_return total;
+}
+
+int main(int argc, char *argv[]) {
+  Hal_Executor executor{"coro", 2};
+  Hal_Async async{"coro-async"};
+  Hal_Pipe<int> input{"coro-input"};
+  std::vector<std::unique_ptr<Hal_LimitBuffer<int>>> buffers{};
+
+  buffers.push_back(std::make_unique<Hal_LimitBuffer<int>>(4));
+  Hal_CoSpawn(executor, stage(input, *buffers.back()));
+
+  for (int i = 1; i < 1000; i++) {
+    buffers.push_back(std::make_unique<Hal_LimitBuffer<int>>(4));
+    Hal_CoSpawn(executor, stage(*buffers[i - 1], *buffers[i]));
+  }
+
+  for (int i = 1; i <= 10; i++) {
+    input.write(i);
+  }
+
+  input.write(-1);
+
+  // 1 + 2 + ... + 10 and 10 items passing 999 adding stages
+  std::cout << "sum from coroutines: "
+            << Hal_CoWait(executor, sum(*buffers.back(), async)) << "\n";
+
+  return 0;
+}
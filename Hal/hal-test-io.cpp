@@ -5,13 +5,15 @@
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <vector>
 
 #include <pthread.h>
 #include <thread>
 #include <unistd.h>
 
-#include "hal-pipe.hpp"
+#include "hal-pipeline.hpp"
 #include "hal-proc.hpp"
+#include "hal-trace.hpp"
 
 std::mutex log_mutex{};
 
@@ -26,6 +28,14 @@ int main(int argc, char *argv[]) {
   using std::chrono::system_clock;
 
   std::map<std::string, long long> input_cnt{};
+
+  // HAL_TRACE=trace.json records the items through the pipeline and dumps
+  // them as a Chrome trace at the end
+  const char *trace_path = getenv("HAL_TRACE");
+  if (nullptr != trace_path) {
+    Hal_Trace::enable();
+  }
+
   Hal_Proc sensor_input{"sensor input"};
   Hal_Proc gps_input{"gps input"};
   Hal_Proc imu_input{"imu input"};
@@ -37,26 +47,43 @@ int main(int argc, char *argv[]) {
   int input_to_sleep_nanoseconds = 500000; /* 0.5 milliseconds */
   int input_to_run_seconds = 5;
 
-  Hal_Pipe<std::string> out_pipe{"out_pipe", [&input_cnt](std::string item) {
-                                   std::size_t found = item.find(": ");
-                                   if (found != std::string::npos) {
-                                     std::string source = item.substr(0, found);
+  // staging is written by the four input threads, the later stages are
+  // cheap forwards, so the pipeline fuses them all onto the staging thread
+  // rather than handing every item over three more threads.
+  Hal_Pipeline<std::string> pipeline{"io"};
+  using Emit = Hal_Pipeline<std::string>::Emit;
 
-                                     input_cnt[source]++;
-                                   }
-                                 }};
+  size_t staging = pipeline.addStage(
+      "staging_input",
+      [](std::string &&item, Emit &emit) { emit(std::move(item)); });
 
-  Hal_Pipe<std::string> cal_pipe{
-      "cal_input", [&out_pipe](std::string item) { out_pipe.write(item); }};
+  size_t filter = pipeline.addStage(
+      "filter_input",
+      [](std::string &&item, Emit &emit) { emit(std::move(item)); });
 
-  Hal_Pipe<std::string> filter_pipe{
-      "filter_input", [&cal_pipe](std::string item) { cal_pipe.write(item); }};
+  size_t cal = pipeline.addStage(
+      "cal_input",
+      [](std::string &&item, Emit &emit) { emit(std::move(item)); });
 
-  Hal_Pipe<std::string> staging_pipe{
-      "staging_input",
-      [&filter_pipe](std::string item) { filter_pipe.write(item); }};
+  size_t out = pipeline.addStage(
+      "out_pipe", [&input_cnt](std::string &&item, Emit &) {
+        std::size_t found = item.find(": ");
+        if (found != std::string::npos) {
+          std::string source = item.substr(0, found);
+
+          input_cnt[source]++;
+        }
+      });
 
-  sensor_input.exec([&staging_pipe, input_to_sleep_use_ns,
+  pipeline.connect(staging, filter);
+  pipeline.connect(filter, cal);
+  pipeline.connect(cal, out);
+  pipeline.build();
+
+  safethread_log(std::cout << "pipeline plan: " << pipeline.describe()
+                           << "\n");
+
+  sensor_input.exec([&pipeline, staging, input_to_sleep_use_ns,
                      input_to_sleep_nanoseconds, input_to_sleep_milliseconds,
                      input_to_run_seconds]() {
     int i{0};
@@ -66,7 +93,7 @@ int main(int argc, char *argv[]) {
     while (true) {
       std::string item =
           "sensor_input: " + std::to_string(i) + ": " + std::string(2000, 'x');
-      staging_pipe.write(item);
+      pipeline.write(staging, std::move(item));
 
       i++;
 
@@ -87,7 +114,7 @@ int main(int argc, char *argv[]) {
     safethread_log(std::cout << "sensor input: end: " << i << "\n");
   });
 
-  gps_input.exec([&staging_pipe, input_to_sleep_use_ns,
+  gps_input.exec([&pipeline, staging, input_to_sleep_use_ns,
                   input_to_sleep_nanoseconds, input_to_sleep_milliseconds,
                   input_to_run_seconds]() {
     int i{0};
@@ -96,7 +123,7 @@ int main(int argc, char *argv[]) {
 
     while (true) {
       std::string item = "gps_input: " + std::to_string(i) + ": data";
-      staging_pipe.write(item);
+      pipeline.write(staging, std::move(item));
 
       i++;
 
@@ -118,7 +145,7 @@ int main(int argc, char *argv[]) {
     safethread_log(std::cout << "gps_input: end: " << i << "\n");
   });
 
-  imu_input.exec([&staging_pipe, input_to_sleep_use_ns,
+  imu_input.exec([&pipeline, staging, input_to_sleep_use_ns,
                   input_to_sleep_nanoseconds, input_to_sleep_milliseconds,
                   input_to_run_seconds]() {
     int i{0};
@@ -127,7 +154,7 @@ int main(int argc, char *argv[]) {
 
     while (true) {
       std::string item = "imu_input: " + std::to_string(i) + ": data";
-      staging_pipe.write(item);
+      pipeline.write(staging, std::move(item));
 
       i++;
 
@@ -149,7 +176,7 @@ int main(int argc, char *argv[]) {
     safethread_log(std::cout << "imu_input: end: " << i << "\n");
   });
 
-  ext_input.exec([&staging_pipe, input_to_sleep_use_ns,
+  ext_input.exec([&pipeline, staging, input_to_sleep_use_ns,
                   input_to_sleep_nanoseconds, input_to_sleep_milliseconds,
                   input_to_run_seconds]() {
     int i{0};
@@ -158,7 +185,7 @@ int main(int argc, char *argv[]) {
 
     while (true) {
       std::string item = "ext_input: " + std::to_string(i) + ": data";
-      staging_pipe.write(item);
+      pipeline.write(staging, std::move(item));
 
       i++;
 
@@ -193,6 +220,13 @@ int main(int argc, char *argv[]) {
     break;
   }
 
+  if (nullptr != trace_path) {
+    size_t events = Hal_Trace::dump(std::string(trace_path));
+
+    safethread_log(std::cout << "trace events: " << events << " written to "
+                             << trace_path << "\n");
+  }
+
   // Hal_Proc and Hal_Pipe will be destroyed and display statistics
 
   return 0;
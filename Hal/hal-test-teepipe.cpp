@@ -1,87 +1,174 @@
 /**
- * This is a test file for teepipe that two threads are reading data and feed
- * into teepipe that will sort the data and make sure that it is processed
- * in order, if the data already sorted in the source data, the teepipe will
- * coordinate high level sorting between two stream of data.
+ * This is a test file for teepipe that two input files are read by one
+ * Hal_IoSource thread and fed into teepipe in merge mode, as the data is
+ * already sorted in each source, the teepipe merges the two streams of data
+ * and makes sure that it is processed in order.
+ *
+ * It then shows, in both merge and lock step mode, how a source that has
+ * nothing to write releases the items of the other sources by advancing its
+ * watermark, and how an idle timeout flushes them when it goes quiet.
  */
 
-#include "hal-proc.hpp"
+#include "hal-io-source.hpp"
 #include "hal-teepipe.hpp"
 
 #include <chrono>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// collects the items moved by a teepipe, as they come on its pipe thread
+class Collector {
+public:
+  void add(long val) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_items.push_back(val);
+  }
+
+  // the items collected once count of them are moved (or after a second),
+  // and a short while after that, so that extra items would show up
+  std::string waitFor(size_t count) {
+    for (int i = 0; i < 1000 && size() < count; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string text{};
+
+    for (long val : m_items) {
+      text += " " + std::to_string(val);
+    }
+
+    m_items.clear();
+
+    return text.empty() ? " none" : text;
+  }
+
+private:
+  size_t size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return m_items.size();
+  }
+
+  std::mutex m_mutex{};
+  std::vector<long> m_items{};
+};
+
+void showMergeWatermark() {
+  Collector collector{};
+  Hal_TeePipe<long> tpipe{
+      "merge-wm", [&collector](long val) { collector.add(val); },
+      [](const long &lhs, const long &rhs) { return lhs < rhs; }};
+  auto fast = tpipe.addHal_TeePipeSource(16);
+  auto slow = tpipe.addHal_TeePipeSource(16);
+
+  fast->write(1);
+  fast->write(2);
+  fast->write(3);
+  std::cout << "merge, slow source empty:" << collector.waitFor(0) << "\n";
+
+  // slow promises that its next item is not before 2
+  slow->advanceWatermark(2);
+  std::cout << "merge, slow watermark 2:" << collector.waitFor(2) << "\n";
+
+  // slow has neither written nor advanced its watermark for the timeout
+  tpipe.setIdleTimeout(std::chrono::milliseconds(50));
+  std::cout << "merge, slow idle:" << collector.waitFor(1) << "\n";
+
+  tpipe.removeHal_TeePipeSource(fast);
+  tpipe.removeHal_TeePipeSource(slow);
+  tpipe.waitForEmpty();
+}
+
+void showLockStepWatermark() {
+  Collector collector{};
+  Hal_TeePipe<long> tpipe{"lockstep-wm",
+                          [&collector](long val) { collector.add(val); }};
+  auto first = tpipe.addHal_TeePipeSource(16);
+  auto second = tpipe.addHal_TeePipeSource(16);
+
+  first->write(10);
+  std::cout << "lock step, second source empty:" << collector.waitFor(0)
+            << "\n";
+
+  // rounds move without second until its next item
+  second->advanceWatermark(0);
+  std::cout << "lock step, second watermark:" << collector.waitFor(1)
+            << "\n";
+
+  // second has an item again, and now first is the empty one
+  second->write(20);
+  std::cout << "lock step, first source empty:" << collector.waitFor(0)
+            << "\n";
+
+  tpipe.setIdleTimeout(std::chrono::milliseconds(50));
+  std::cout << "lock step, first idle:" << collector.waitFor(1) << "\n";
+
+  tpipe.removeHal_TeePipeSource(first);
+  tpipe.removeHal_TeePipeSource(second);
+  tpipe.waitForEmpty();
+}
+
 int main(int argc, char *argv[]) {
   std::vector<std::string> files{"./teepipe-test-data-1.txt",
                                  "./teepipe-test-data-2.txt"};
   Hal_TeePipe<long> tpipe{
       "teepipe", [](long val) { std::cout << val << "\n"; },
-      [](std::vector<long> list) { std::sort(list.begin(), list.end()); }};
-  std::vector<std::unique_ptr<Hal_Proc>> proclist{};
+      [](const long &lhs, const long &rhs) { return lhs < rhs; }};
+  Hal_IoSource ioSource{"io-source"};
 
   for (auto &filename : files) {
-    auto tpipeSource = tpipe.addHal_TeePipeSource();
-    auto proc = std::make_unique<Hal_Proc>(
-        filename, [&tpipe, tpipeSource, filename, prog = argv[0]]() {
-          int fd{};
-          FILE *file{};
-          char buf[BUFSIZ]{};
-
-          fd = open(filename.c_str(), O_RDONLY);
-          if (-1 == fd) {
-            perror(prog);
-            exit(1);
-          }
-
-          file = fdopen(fd, "r");
-          if (NULL == file) {
-            perror(prog);
-            exit(1);
-          }
-
-          while (fgets(buf, sizeof(buf), file) != NULL) {
-            if ('\n' == buf[strlen(buf) - 1]) {
-              buf[strlen(buf) - 1] = '\0';
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (-1 == fd) {
+      perror(argv[0]);
+      exit(1);
+    }
+
+    auto tpipeSource = tpipe.addHal_TeePipeSource(16);
+
+    ioSource.add(
+        fd, std::make_unique<Hal_LineFramer>(),
+        // the one source thread reads both files, so it takes only the
+        // lines that fit in the source rather than block on a full one
+        [tpipeSource](std::vector<std::string> &lines) {
+          size_t taken = 0;
+
+          for (; taken < lines.size(); taken++) {
+            if (Hal_PushStatus::TimedOut ==
+                tpipeSource->writeFor(strtol(lines[taken].c_str(), NULL, 10),
+                                      std::chrono::nanoseconds::zero())) {
+              break;
             }
-
-            long val{};
-            val = strtol(buf, NULL, 10);
-
-            tpipeSource->write(val);
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
           }
 
-          if (ferror(file)) {
-            perror(prog);
+          return taken;
+        },
+        [&tpipe, tpipeSource, prog = argv[0]](int err) mutable {
+          if (err) {
+            std::cerr << prog << ": " << strerror(err) << "\n";
             exit(1);
           }
 
-          fclose(file);
+          tpipe.removeHal_TeePipeSource(tpipeSource);
         });
-
-    proclist.push_back(std::move(proc));
-  }
-
-  for (auto &proc : proclist) {
-    proc->exec();
-    Hal_Proc::yield();
-  }
-
-  Hal_Proc::yield();
-
-  for (auto &proc : proclist) {
-    proc->wait();
   }
 
+  ioSource.waitForClosed();
   tpipe.waitForEmpty();
 
+  showMergeWatermark();
+  showLockStepWatermark();
+
   return 0;
 }
@@ -1,13 +1,21 @@
 #include "hal-async.hpp"
+#include "hal-broadcast-pipe.hpp"
 #include "hal-buffer.hpp"
 #include "hal-limit-buffer.hpp"
 #include "hal-pipe.hpp"
+#include "hal-priority-pipe.hpp"
 #include "hal-proc.hpp"
+#include "hal-sharded-buffer.hpp"
 #include "hal-teepipe.hpp"
+#include "hal-timer.hpp"
+#include "hal-wait-strategy.hpp"
 #include "hal.hpp"
 #include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <utility>
 
 /* An example usage of hal async where we can wrap the api body within
  * hal async call to serialize multiple api called from different threads,
@@ -27,6 +35,30 @@ private:
   long count{};
 };
 
+/* Writes 1 to 1000 through a pipe whose consumer (and producer, if the
+ * buffer is bounded) waits with waitStrategy, and returns what arrived.
+ */
+template <typename Buffer>
+std::string pipeWith(Hal_WaitStrategy waitStrategy) {
+  std::atomic<long> count{};
+  std::atomic<long> sum{};
+  Hal_Pipe<long, Buffer> pipe{"wait-strategy", [&count, &sum](long &&val) {
+                                count++;
+                                sum += val;
+                              }};
+
+  pipe.setWaitStrategy(waitStrategy);
+
+  for (long val = 1; val <= 1000; val++) {
+    pipe.write(val);
+  }
+
+  pipe.waitForEmpty();
+
+  return std::to_string(count) + " items, sum " + std::to_string(sum) +
+         (1000 == count && 500500 == sum ? " (all arrived)" : " (missing)");
+}
+
 int main(int argc, char *argv[]) {
   Hal_TeePipe<int> sortPipe{
       "sortPipe", [](int v) { std::cout << "val: " << v << "\n"; },
@@ -66,6 +98,12 @@ int main(int argc, char *argv[]) {
   ha.write(functor);
   ha.waitForEmpty();
 
+  auto answer =
+      ha.call([]() { return 6; })
+          .then([](int val) { return val * 7; })
+          .then([](int val) { return "answer: " + std::to_string(val); });
+  std::cout << answer.get() << "\n";
+
   using namespace std::string_literals;
 
   Hal_Event e{};
@@ -79,12 +117,16 @@ int main(int argc, char *argv[]) {
   std::cout << "End of Hal test\n";
 
   {
-    Hal_Proc nonestop{"none-stop", []() {
-                        std::cout << "start none-stop\n";
+    Hal_ProcOptions options{{sched_getcpu()}, SCHED_OTHER, 0, 256 * 1024};
+    Hal_Proc nonestop{"none-stop",
+                      []() {
+                        std::cout << "start none-stop on cpu "
+                                  << sched_getcpu() << "\n";
                         while (true) {
                           Hal_Proc::yield();
                         }
-                      }};
+                      },
+                      options};
     nonestop.exec();
     Hal_Proc::yield();
   }
@@ -105,5 +147,145 @@ int main(int argc, char *argv[]) {
   std::cout << "value from Pipe: " << valFromPipe
             << ", value to Pipe: " << valToPipe << "\n";
 
+  Hal_Pipe<std::unique_ptr<std::string>> uniquePipe{"unique"};
+  uniquePipe.emplace(new std::string{"Hello Unique Pipe"});
+  std::cout << "value from unique Pipe: " << *uniquePipe.read() << "\n";
+
+  std::vector<std::string> batchToPipe{"Hello", "Batch", "Pipe"};
+  pipe.writeBatch(batchToPipe.begin(), batchToPipe.end());
+  pipe.readAndProcessBatch(
+      [](std::vector<std::string> &&items) {
+        std::cout << "batch from Pipe:";
+        for (auto &item : items) {
+          std::cout << " " << item;
+        }
+        std::cout << "\n";
+      },
+      10);
+
+  // metrics are recorded by the buffers and pipes created from now on
+  Hal_Metrics::enable();
+
+  std::atomic<long> sum{};
+  Hal_Pipe<long> workersPipe{"workers",
+                             [&sum](long &&val) { sum += val * val; }, 4};
+
+  for (long val = 1; val <= 100; val++) {
+    workersPipe.write(val);
+  }
+
+  // drains the 100 values before the 4 workers are stopped
+  workersPipe.stop(Hal_Pipe<long>::StopMode::Drain);
+  std::cout << "sum of squares from 4 workers: " << sum << "\n";
+
+  for (auto &[name, metrics] : Hal_MetricsRegistry::getDefault().snapshot()) {
+    if ("workers" == name) {
+      std::cout << "metrics of workers: pushed " << metrics.pushCount
+                << ", popped " << metrics.popCount << ", processed "
+                << metrics.processing.count << "\n";
+    }
+  }
+
+  std::pair<const char *, Hal_WaitStrategy> waitStrategies[]{
+      {"block", Hal_WaitStrategy::block()},
+      {"spin then park", Hal_WaitStrategy::spinThenPark()},
+      {"busy poll", Hal_WaitStrategy::busyPoll()}};
+  for (auto &[name, waitStrategy] : waitStrategies) {
+    std::cout << name << " pipe: " << pipeWith<Hal_Buffer<long>>(waitStrategy)
+              << ", bounded: "
+              << pipeWith<Hal_LimitBuffer<long>>(waitStrategy) << "\n";
+  }
+
+  // every producer pushes to a lane of its own, the one worker reads them all
+  std::atomic<long> shardedCount{};
+  std::atomic<long> shardedSum{};
+  Hal_Pipe<long, Hal_ShardedBuffer<long>> shardedPipe{
+      "sharded", [&shardedCount, &shardedSum](long &&val) {
+        shardedCount++;
+        shardedSum += val;
+      }};
+  std::vector<std::unique_ptr<Hal_Proc>> producers{};
+  for (int i = 0; i < 4; i++) {
+    producers.push_back(
+        std::make_unique<Hal_Proc>("producer", [&shardedPipe]() {
+          for (long val = 1; val <= 250; val++) {
+            shardedPipe.write(val);
+          }
+        }));
+    producers.back()->exec();
+  }
+
+  for (auto &producer : producers) {
+    producer->wait();
+  }
+
+  shardedPipe.waitForEmpty();
+  std::cout << "sharded pipe from 4 producers: " << shardedCount
+            << " items, sum " << shardedSum
+            << (1000 == shardedCount && 4 * 31375 == shardedSum
+                    ? " (all arrived)"
+                    : " (missing)")
+            << "\n";
+
+  Hal_LimitBuffer<int> latest{2};
+  latest.setOverflowPolicy(Hal_OverflowPolicy::DropOldest);
+  for (int val = 1; val <= 5; val++) {
+    latest.push(val);
+  }
+
+  std::cout << "latest of 1 to 5 in a buffer of 2: " << latest.pop() << " "
+            << latest.pop() << ", dropped " << latest.drops().oldest << "\n";
+
+  // without a thread, so the control message written last is read first
+  Hal_PriorityPipe<std::string> controlPipe{"control"};
+  controlPipe.write("bulk 1");
+  controlPipe.write("bulk 2");
+  controlPipe.write("stop", 10);
+  std::cout << "from priority Pipe: " << controlPipe.read();
+  std::cout << " " << controlPipe.read() << " " << controlPipe.read() << "\n";
+
+  Hal_Timer timer{"timer"};
+  Hal_Pipe<std::string> timeoutPipe{"timeouts"};
+  Hal_Timer::Id cancelled = timer.writeAfter(
+      std::chrono::milliseconds(5), timeoutPipe, std::string{"cancelled"});
+  timer.writeAfter(std::chrono::milliseconds(10), timeoutPipe,
+                   std::string{"timeout"});
+  timer.cancel(cancelled);
+  std::cout << "from timer: " << timeoutPipe.read() << "\n";
+
+  Hal_Pipe<int> heartbeatPipe{"heartbeats"};
+  Hal_Timer::Id heartbeat =
+      timer.writeEvery(std::chrono::milliseconds(1), heartbeatPipe, 1);
+  int beats{};
+  for (int i = 0; i < 3; i++) {
+    beats += heartbeatPipe.read();
+  }
+
+  timer.cancel(heartbeat);
+  std::cout << "heartbeats from timer: " << beats << "\n";
+
+  // every subscriber reads the same 10 items, none is copied
+  Hal_BroadcastPipe<long> broadcastPipe{"broadcast", 4};
+  std::atomic<long> broadcastSums[3]{};
+  for (auto &broadcastSum : broadcastSums) {
+    broadcastPipe.subscribe(
+        "subscriber",
+        [&broadcastSum](const Hal_BroadcastPipe<long>::Item &val) {
+          broadcastSum += *val;
+        });
+  }
+
+  for (long val = 1; val <= 10; val++) {
+    broadcastPipe.write(val);
+  }
+
+  broadcastPipe.waitForEmpty();
+  std::cout << "sums from broadcast pipe:";
+  for (auto &broadcastSum : broadcastSums) {
+    std::cout << " " << broadcastSum;
+  }
+
+  std::cout << ", lag " << broadcastPipe.lags()[0].lag << "\n";
+
   return 0;
 }
@@ -0,0 +1,382 @@
+#include "hal-timer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+#include <pthread.h>
+#include <time.h>
+
+static int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Hal_Timer::Hal_Timer(std::string_view name,
+                     std::chrono::nanoseconds resolution)
+    : Hal_Proc{name}, m_resolution{resolution.count()}, m_start{nowNs()},
+      m_wheel(kLevels * kSlots) {
+  int err{};
+
+  if (m_resolution <= 0) {
+    throw std::invalid_argument("Hal_Timer resolution must be positive");
+  }
+
+  err = pthread_mutex_init(&m_mutex, NULL);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  // the thread sleeps until a tick of the steady clock, which is
+  // CLOCK_MONOTONIC.
+  pthread_condattr_t condAttr{};
+
+  err = pthread_condattr_init(&condAttr);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  err = pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  if (err) {
+    pthread_condattr_destroy(&condAttr);
+
+    throw std::runtime_error(strerror(err));
+  }
+
+  err = pthread_cond_init(&m_cond, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+
+  exec([this]() { run(); });
+}
+
+Hal_Timer::~Hal_Timer() noexcept try {
+  stop();
+
+  pthread_cond_destroy(&m_cond);
+  pthread_mutex_destroy(&m_mutex);
+} catch (...) {
+  // explicit return to resolve exception as destructor must be noexcept
+  return;
+}
+
+Hal_Timer::Id Hal_Timer::scheduleAfter(std::chrono::nanoseconds delay,
+                                       Hal_Timer::Task fn) {
+  return schedule(delay, std::chrono::nanoseconds::zero(), std::move(fn));
+}
+
+Hal_Timer::Id Hal_Timer::scheduleEvery(std::chrono::nanoseconds period,
+                                       Hal_Timer::Task fn) {
+  if (period <= std::chrono::nanoseconds::zero()) {
+    throw std::invalid_argument("Hal_Timer period must be positive");
+  }
+
+  return schedule(period, period, std::move(fn));
+}
+
+Hal_Timer::Id Hal_Timer::scheduleAfter(std::chrono::nanoseconds delay,
+                                       Hal_Async &async, Hal_Timer::Task fn) {
+  return scheduleAfter(delay, [&async, fn = std::move(fn)]() mutable {
+    async.write(std::move(fn));
+  });
+}
+
+Hal_Timer::Id Hal_Timer::scheduleEvery(std::chrono::nanoseconds period,
+                                       Hal_Async &async, Hal_Timer::Task fn) {
+  // every run writes a task to async, they share the one fn.
+  auto shared = std::make_shared<const Hal_Timer::Task>(std::move(fn));
+
+  return scheduleEvery(period, [&async, shared]() {
+    async.write([shared]() { (*shared)(); });
+  });
+}
+
+bool Hal_Timer::cancel(Hal_Timer::Id id) {
+  lock();
+
+  auto iter = m_timers.find(id);
+  bool found = iter != m_timers.end();
+
+  if (found) {
+    Slot::iterator timer = iter->second;
+
+    timer->slot->erase(timer);
+    m_timers.erase(iter);
+  }
+
+  unlock();
+
+  return found;
+}
+
+size_t Hal_Timer::size() {
+  lock();
+  size_t count = m_timers.size();
+  unlock();
+
+  return count;
+}
+
+void Hal_Timer::stop() {
+  if (isRunning()) {
+    requestStop();
+
+    Hal_Proc::wait();
+  }
+
+  lock();
+
+  for (auto &slot : m_wheel) {
+    slot.clear();
+  }
+
+  m_timers.clear();
+  unlock();
+}
+
+Hal_Timer &Hal_Timer::getDefault() {
+  static Hal_Timer timer{"hal-timer"};
+
+  return timer;
+}
+
+Hal_Timer::Id Hal_Timer::schedule(std::chrono::nanoseconds delay,
+                                  std::chrono::nanoseconds period,
+                                  Hal_Timer::Task fn) {
+  Slot pending{};
+  Timer &timer = pending.emplace_back();
+
+  timer.fn = std::make_shared<const Hal_Timer::Task>(std::move(fn));
+  timer.period = period.count() > 0 ? std::max<uint64_t>(1, toTicks(period))
+                                    : 0;
+
+  // a tick is run once the clock is past its start, so the delay is rounded
+  // up to whole ticks from the current one.
+  uint64_t expiry =
+      (nowNs() - m_start + std::max<int64_t>(0, delay.count()) +
+       m_resolution - 1) /
+      m_resolution;
+
+  lock();
+
+  timer.id = m_nextId++;
+  timer.expiry = std::max(expiry, m_tick);
+
+  Hal_Timer::Id id = timer.id;
+  bool wakeup = 0 != m_wakeTick && timer.expiry < m_wakeTick;
+
+  m_timers[id] = pending.begin();
+  place(pending.begin(), pending);
+
+  if (wakeup) {
+    int err = pthread_cond_signal(&m_cond);
+    if (err) {
+      unlock();
+
+      throw std::runtime_error(strerror(err));
+    }
+  }
+
+  unlock();
+
+  return id;
+}
+
+void Hal_Timer::run() {
+  std::vector<std::shared_ptr<const Hal_Timer::Task>> expired{};
+
+  while (!Hal_Proc::stopRequested()) {
+    lock();
+
+    uint64_t tick = currentTick();
+
+    while (m_tick <= tick) {
+      // nothing is due before the next tick that has a timer or turns level
+      // 0 around, so the idle ticks up to it are skipped rather than run.
+      m_tick = std::min(nextTick(), tick + 1);
+
+      if (m_tick <= tick) {
+        advance(expired);
+      }
+    }
+
+    if (expired.empty()) {
+      waitForTick();
+    }
+
+    unlock();
+
+    // the tasks run without the mutex, so that they can schedule or cancel
+    // timers.
+    for (auto &fn : expired) {
+      (*fn)();
+    }
+
+    expired.clear();
+  }
+}
+
+void Hal_Timer::advance(
+    std::vector<std::shared_ptr<const Hal_Timer::Task>> &expired) {
+  // a turn of a level moves the timers of the next slot of the level above
+  // down, before the tick runs.
+  for (size_t level = 1; level < kLevels; level++) {
+    size_t shift = level * kSlotBits;
+
+    if (0 != (m_tick & ((uint64_t{1} << shift) - 1))) {
+      break;
+    }
+
+    cascade(m_wheel[level * kSlots + ((m_tick >> shift) & kSlotMask)]);
+  }
+
+  Slot due{};
+
+  due.splice(due.end(), m_wheel[m_tick & kSlotMask]);
+
+  while (!due.empty()) {
+    Slot::iterator timer = due.begin();
+
+    // placed early as it was further ahead than the wheel spans
+    if (timer->expiry > m_tick) {
+      place(timer, due);
+
+      continue;
+    }
+
+    expired.push_back(timer->fn);
+
+    if (0 == timer->period) {
+      m_timers.erase(timer->id);
+      due.erase(timer);
+
+      continue;
+    }
+
+    // keeps the phase of the period, and skips the runs that are missed
+    timer->expiry += timer->period;
+    if (timer->expiry <= m_tick) {
+      timer->expiry +=
+          ((m_tick - timer->expiry) / timer->period + 1) * timer->period;
+    }
+
+    place(timer, due);
+  }
+
+  ++m_tick;
+}
+
+void Hal_Timer::cascade(Hal_Timer::Slot &slot) {
+  Slot timers{};
+
+  timers.splice(timers.end(), slot);
+
+  while (!timers.empty()) {
+    place(timers.begin(), timers);
+  }
+}
+
+void Hal_Timer::place(Hal_Timer::Slot::iterator timer, Hal_Timer::Slot &from) {
+  Slot &slot = slotFor(timer->expiry);
+
+  // splice keeps the iterator in m_timers valid
+  slot.splice(slot.end(), from, timer);
+  timer->slot = &slot;
+}
+
+Hal_Timer::Slot &Hal_Timer::slotFor(uint64_t expiry) {
+  uint64_t delta = std::min(expiry - m_tick, kMaxTicks);
+  size_t level = 0;
+
+  expiry = m_tick + delta;
+
+  while (level + 1 < kLevels &&
+         delta >= (uint64_t{1} << ((level + 1) * kSlotBits))) {
+    level++;
+  }
+
+  return m_wheel[level * kSlots +
+                 ((expiry >> (level * kSlotBits)) & kSlotMask)];
+}
+
+uint64_t Hal_Timer::nextTick() const {
+  if (m_timers.empty()) {
+    return kNever;
+  }
+
+  // the first due tick of level 0 up to its next turn, at which the level
+  // above may move timers down
+  uint64_t tick = m_tick;
+
+  if (0 == (tick & kSlotMask)) {
+    return tick;
+  }
+
+  for (; 0 != (tick & kSlotMask); tick++) {
+    if (!m_wheel[tick & kSlotMask].empty()) {
+      return tick;
+    }
+  }
+
+  return tick;
+}
+
+void Hal_Timer::waitForTick() {
+  int err{};
+  uint64_t tick = nextTick();
+
+  if (tick <= currentTick()) {
+    return;
+  }
+
+  m_wakeTick = tick;
+
+  if (kNever == tick) {
+    err = Hal_Proc::condWait(&m_cond, &m_mutex);
+  } else {
+    int64_t ns = m_start + (int64_t)tick * m_resolution;
+    struct timespec abstime{};
+
+    abstime.tv_sec = ns / 1000000000;
+    abstime.tv_nsec = ns % 1000000000;
+
+    err = Hal_Proc::condTimedWait(&m_cond, &m_mutex, &abstime);
+  }
+
+  m_wakeTick = 0;
+
+  if (err && ETIMEDOUT != err) {
+    unlock();
+
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+uint64_t Hal_Timer::toTicks(std::chrono::nanoseconds duration) const {
+  return (duration.count() + m_resolution - 1) / m_resolution;
+}
+
+uint64_t Hal_Timer::currentTick() const {
+  return (nowNs() - m_start) / m_resolution;
+}
+
+void Hal_Timer::lock() {
+  int err = pthread_mutex_lock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+void Hal_Timer::unlock() {
+  int err = pthread_mutex_unlock(&m_mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
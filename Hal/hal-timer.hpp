@@ -0,0 +1,176 @@
+/**
+ * This module implements Hal_Timer, one thread that runs many delayed and
+ * periodic tasks (timeouts, heartbeats) instead of a thread per task
+ * sleeping in a loop.
+ *
+ * The timers are kept in a hierarchical timing wheel of kLevels levels of
+ * kSlots slots, a slot of level 0 is one tick (the resolution, 1ms by
+ * default) and a slot of a higher level spans a whole turn of the level
+ * below. Scheduling and cancelling a timer are O(1), a timer of a higher
+ * level is moved one level down when the level below turns around, and the
+ * thread only wakes up for a tick that has a timer due or a turn of level 0,
+ * not for every tick.
+ *
+ * A task runs on the timer thread, so it should be short, or it is handed
+ * to a Hal_Async (or written to a Hal_Pipe) that runs it elsewhere.
+ */
+
+#ifndef HAL_TIMER_HPP_HAVE_SEEN
+
+#define HAL_TIMER_HPP_HAVE_SEEN
+
+#include "hal-async.hpp"
+#include "hal-proc.hpp"
+#include "hal-task.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+class Hal_Timer : public Hal_Proc {
+public:
+  using Task = Hal_Task<void()>;
+
+  // 0 is never a timer id, so it can be used for no timer.
+  using Id = uint64_t;
+
+  static constexpr std::chrono::nanoseconds kDefaultResolution =
+      std::chrono::milliseconds(1);
+
+  Hal_Timer(std::string_view name,
+            std::chrono::nanoseconds resolution = kDefaultResolution);
+  virtual ~Hal_Timer() noexcept;
+
+  Hal_Timer(const Hal_Timer &halTimer) = delete;
+  const Hal_Timer &operator=(const Hal_Timer &halTimer) = delete;
+  Hal_Timer(Hal_Timer &&halTimer) = delete;
+  Hal_Timer &operator=(Hal_Timer &&halTimer) = delete;
+
+  /**
+   * Runs fn once on the timer thread after delay, rounded up to the
+   * resolution.
+   */
+  Hal_Timer::Id scheduleAfter(std::chrono::nanoseconds delay,
+                              Hal_Timer::Task fn);
+
+  /**
+   * Runs fn on the timer thread every period, the first time after one
+   * period. A run that is late does not shift the later ones, and the runs
+   * missed while the thread is late are skipped.
+   */
+  Hal_Timer::Id scheduleEvery(std::chrono::nanoseconds period,
+                              Hal_Timer::Task fn);
+
+  /**
+   * Writes fn to async after delay, so that it runs in the order of the
+   * other tasks of async.
+   */
+  Hal_Timer::Id scheduleAfter(std::chrono::nanoseconds delay,
+                              Hal_Async &async, Hal_Timer::Task fn);
+
+  Hal_Timer::Id scheduleEvery(std::chrono::nanoseconds period,
+                              Hal_Async &async, Hal_Timer::Task fn);
+
+  /**
+   * Writes item to pipe (anything with write) after delay.
+   */
+  template <typename Pipe, typename Item>
+  Hal_Timer::Id writeAfter(std::chrono::nanoseconds delay, Pipe &pipe,
+                           Item item) {
+    return scheduleAfter(delay, [&pipe, item = std::move(item)]() mutable {
+      pipe.write(std::move(item));
+    });
+  }
+
+  /**
+   * Writes a copy of item to pipe every period.
+   */
+  template <typename Pipe, typename Item>
+  Hal_Timer::Id writeEvery(std::chrono::nanoseconds period, Pipe &pipe,
+                           Item item) {
+    return scheduleEvery(period,
+                         [&pipe, item]() { pipe.write(Item{item}); });
+  }
+
+  /**
+   * Returns false if the timer has run (once) or is cancelled already. A
+   * run that is taken by the timer thread just before may still happen.
+   */
+  bool cancel(Hal_Timer::Id id);
+
+  /**
+   * The number of timers that are scheduled.
+   */
+  size_t size();
+
+  /**
+   * Stops the timer thread, the timers left are not run.
+   */
+  void stop();
+
+  /**
+   * The process wide timer with the default resolution.
+   */
+  static Hal_Timer &getDefault();
+
+private:
+  static constexpr size_t kLevels = 4;
+  static constexpr size_t kSlotBits = 8;
+  static constexpr size_t kSlots = size_t{1} << kSlotBits;
+  static constexpr uint64_t kSlotMask = kSlots - 1;
+
+  // the furthest tick ahead a timer can be placed at, a timer beyond it is
+  // placed there and moved on when it comes down to level 0.
+  static constexpr uint64_t kMaxTicks =
+      (uint64_t{1} << (kLevels * kSlotBits)) - 1;
+
+  static constexpr uint64_t kNever = UINT64_MAX;
+
+  struct Timer;
+
+  using Slot = std::list<Timer>;
+
+  struct Timer {
+    Hal_Timer::Id id{};
+    uint64_t expiry{}; // tick
+    uint64_t period{}; // ticks, 0 for a one-shot timer
+    std::shared_ptr<const Hal_Timer::Task> fn{};
+    Slot *slot{};
+  };
+
+  Hal_Timer::Id schedule(std::chrono::nanoseconds delay,
+                         std::chrono::nanoseconds period, Hal_Timer::Task fn);
+  void run();
+  void advance(std::vector<std::shared_ptr<const Hal_Timer::Task>> &expired);
+  void cascade(Slot &slot);
+  void place(Slot::iterator timer, Slot &from);
+  Slot &slotFor(uint64_t expiry);
+  uint64_t nextTick() const;
+  void waitForTick();
+  uint64_t toTicks(std::chrono::nanoseconds duration) const;
+  uint64_t currentTick() const;
+  void lock();
+  void unlock();
+
+  const int64_t m_resolution{}; // ns
+  const int64_t m_start{};      // ns of the steady clock at tick 0
+
+  // guarded by m_mutex
+  pthread_mutex_t m_mutex{};
+  pthread_cond_t m_cond{};
+  std::vector<Slot> m_wheel{};
+  std::unordered_map<Hal_Timer::Id, Slot::iterator> m_timers{};
+  uint64_t m_tick{};     // the next tick to run
+  uint64_t m_wakeTick{}; // the tick the thread sleeps until, 0 if awake
+  Hal_Timer::Id m_nextId{1};
+};
+
+#endif /* HAL_TIMER_HPP_HAVE_SEEN */
@@ -0,0 +1,359 @@
+#include "hal-trace.hpp"
+#include "hal-proc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+std::atomic<bool> Hal_Trace::s_enabled{};
+
+// the fields are atomics, as dump reads a ring while its thread may be
+// overwriting it.
+struct Hal_Trace::Record {
+  std::atomic<uint64_t> time{};
+  std::atomic<uint64_t> word{}; // name << 8 | event
+  std::atomic<uint64_t> count{};
+};
+
+struct Hal_Trace::Ring {
+  std::string thread{};
+  uint64_t capacity{};
+  std::unique_ptr<Record[]> records{};
+  std::atomic<uint64_t> head{}; // written by the thread of the ring only
+  uint64_t start{};             // the first event not cleared
+  bool ended{}; // the thread is gone, the ring is freed once dumped
+};
+
+// marks the ring of a thread as ended when the thread exits
+struct Hal_Trace::RingOwner {
+  ~RingOwner() noexcept try {
+    if (nullptr != ring) {
+      Recorder &recorder = getRecorder();
+
+      lock(recorder);
+      ring->ended = true;
+      ring = nullptr;
+      unlock(recorder);
+    }
+  } catch (...) {
+    // explicit return to resolve exception as destructor must be noexcept
+    return;
+  }
+
+  Ring *ring{};
+};
+
+struct Hal_Trace::Event {
+  uint64_t time{};
+  uint64_t word{};
+  uint64_t count{};
+};
+
+struct Hal_Trace::Recorder {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  size_t capacity{kDefaultCapacity};
+  std::vector<std::unique_ptr<Ring>> rings{};
+  uint64_t threads{}; // the number of rings added, to name the threads
+  std::vector<std::string> names{};
+  std::unordered_map<std::string, uint32_t> ids{};
+
+  // a time counter and steady clock reading taken together, to convert
+  // the counter to time at dump
+  uint64_t startTime{};
+  uint64_t startNs{};
+};
+
+Hal_Trace::Recorder &Hal_Trace::getRecorder() {
+  static Recorder recorder{};
+
+  return recorder;
+}
+
+static uint64_t readTime() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+static uint64_t readNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Hal_Trace::lock(Hal_Trace::Recorder &recorder) {
+  int err = pthread_mutex_lock(&recorder.mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+void Hal_Trace::unlock(Hal_Trace::Recorder &recorder) {
+  int err = pthread_mutex_unlock(&recorder.mutex);
+  if (err) {
+    throw std::runtime_error(strerror(err));
+  }
+}
+
+Hal_Trace::Ring *Hal_Trace::addRing() {
+  Recorder &recorder = getRecorder();
+  auto ring = std::make_unique<Ring>();
+
+  lock(recorder);
+
+  Hal_Proc *proc = Hal_Proc::getCurrent();
+
+  ring->thread = nullptr != proc
+                     ? proc->getName()
+                     : "thread " + std::to_string(recorder.threads + 1);
+  ring->capacity = recorder.capacity;
+  ring->records = std::make_unique<Record[]>(ring->capacity);
+
+  Ring *added = ring.get();
+  recorder.rings.push_back(std::move(ring));
+  recorder.threads++;
+
+  unlock(recorder);
+
+  return added;
+}
+
+void Hal_Trace::releaseEndedRings(Hal_Trace::Recorder &recorder) {
+  recorder.rings.erase(std::remove_if(recorder.rings.begin(),
+                                      recorder.rings.end(),
+                                      [](auto &ring) { return ring->ended; }),
+                       recorder.rings.end());
+}
+
+static void writeEscaped(std::ostream &os, const std::string &text) {
+  for (unsigned char c : text) {
+    if ('"' == c || '\\' == c) {
+      os << '\\' << c;
+    } else if (c < 0x20) {
+      char escaped[8]{};
+
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      os << escaped;
+    } else {
+      os << c;
+    }
+  }
+}
+
+void Hal_Trace::enable(size_t capacity) {
+  Recorder &recorder = getRecorder();
+
+  lock(recorder);
+
+  recorder.capacity = 1;
+  while (recorder.capacity < capacity) {
+    recorder.capacity <<= 1;
+  }
+
+  if (0 == recorder.startNs) {
+    recorder.startTime = readTime();
+    recorder.startNs = readNs();
+  }
+
+  unlock(recorder);
+
+  s_enabled.store(true, std::memory_order_relaxed);
+}
+
+void Hal_Trace::disable() { s_enabled.store(false, std::memory_order_relaxed); }
+
+uint32_t Hal_Trace::intern(std::string_view name) {
+  Recorder &recorder = getRecorder();
+
+  lock(recorder);
+
+  auto [iter, added] = recorder.ids.try_emplace(
+      std::string(name), (uint32_t)recorder.names.size());
+  if (added) {
+    recorder.names.emplace_back(name);
+  }
+
+  uint32_t id = iter->second;
+
+  unlock(recorder);
+
+  return id;
+}
+
+void Hal_Trace::append(uint32_t name, Hal_TraceEvent event, uint64_t count) {
+  // the ring of the calling thread, kept after the thread ends until it is
+  // dumped or cleared.
+  static thread_local RingOwner t_owner{};
+
+  if (nullptr == t_owner.ring) {
+    t_owner.ring = addRing();
+  }
+
+  Ring &ring = *t_owner.ring;
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  Record &record = ring.records[head & (ring.capacity - 1)];
+
+  // a dump that reads any of the fields below also sees the head before
+  // this event, so it knows the slot may be overwritten (as a seqlock).
+  std::atomic_thread_fence(std::memory_order_release);
+
+  record.time.store(readTime(), std::memory_order_relaxed);
+  record.word.store((uint64_t)name << 8 | (uint64_t)event,
+                    std::memory_order_relaxed);
+  record.count.store(count, std::memory_order_relaxed);
+
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+void Hal_Trace::clear() {
+  Recorder &recorder = getRecorder();
+
+  lock(recorder);
+
+  for (auto &ring : recorder.rings) {
+    ring->start = ring->head.load(std::memory_order_acquire);
+  }
+
+  releaseEndedRings(recorder);
+
+  unlock(recorder);
+}
+
+size_t Hal_Trace::dump(std::ostream &os) {
+  Recorder &recorder = getRecorder();
+  std::vector<std::string> threads{};
+  std::vector<std::vector<Event>> events{};
+  std::vector<std::string> names{};
+  uint64_t startTime{};
+  uint64_t startNs{};
+
+  lock(recorder);
+
+  for (auto &ring : recorder.rings) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t first = head > ring->capacity ? head - ring->capacity : 0;
+    std::vector<Event> copied{};
+
+    first = std::max(first, ring->start);
+
+    for (uint64_t i = first; i < head; i++) {
+      Record &record = ring->records[i & (ring->capacity - 1)];
+
+      copied.push_back(
+          Event{record.time.load(std::memory_order_relaxed),
+                record.word.load(std::memory_order_relaxed),
+                record.count.load(std::memory_order_relaxed)});
+    }
+
+    // leave out the events that the thread has overwritten (or is
+    // overwriting) while they were copied
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    uint64_t lastHead = ring->head.load(std::memory_order_relaxed);
+
+    if (lastHead >= first + ring->capacity) {
+      uint64_t overwritten =
+          std::min<uint64_t>(lastHead - ring->capacity + 1 - first,
+                             copied.size());
+
+      copied.erase(copied.begin(), copied.begin() + overwritten);
+    }
+
+    threads.push_back(ring->thread);
+    events.push_back(std::move(copied));
+  }
+
+  names = recorder.names;
+  startTime = recorder.startTime;
+  startNs = recorder.startNs;
+
+  releaseEndedRings(recorder);
+
+  unlock(recorder);
+
+  // the time counter ticks per ns since enable, 1 if it is the clock
+  uint64_t endTime = readTime();
+  uint64_t endNs = readNs();
+  double ticksPerNs = endNs > startNs && endTime > startTime
+                          ? (double)(endTime - startTime) / (endNs - startNs)
+                          : 1.0;
+
+  static const char *const kPhases[] = {"i", "i", "B", "E"};
+  static const char *const kPrefixes[] = {"push ", "pop ", "", ""};
+
+  pid_t pid = getpid();
+  size_t written{};
+  const char *separator = "";
+
+  os << "{\"traceEvents\":[\n";
+
+  for (size_t tid = 0; tid < threads.size(); tid++) {
+    os << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+       << ",\"tid\":" << tid + 1 << ",\"args\":{\"name\":\"";
+    writeEscaped(os, threads[tid]);
+    os << "\"}}";
+    separator = ",\n";
+
+    for (auto &event : events[tid]) {
+      uint32_t name = event.word >> 8;
+      size_t kind = std::min<size_t>(event.word & 0xff, 3);
+      char ts[32]{};
+
+      double ns = ((double)event.time - startTime) / ticksPerNs;
+
+      snprintf(ts, sizeof(ts), "%.3f", ns / 1000.0);
+
+      os << separator << "{\"name\":\"" << kPrefixes[kind];
+      writeEscaped(os, name < names.size() ? names[name] : "?");
+      os << "\",\"cat\":\"hal\",\"ph\":\"" << kPhases[kind] << "\"";
+
+      if (kind < 2) {
+        os << ",\"s\":\"t\"";
+      }
+
+      os << ",\"ts\":" << ts << ",\"pid\":" << pid << ",\"tid\":" << tid + 1
+         << ",\"args\":{\"count\":" << event.count << "}}";
+
+      written++;
+    }
+  }
+
+  os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+  return written;
+}
+
+size_t Hal_Trace::dump(const std::string &path) {
+  std::ofstream file{path};
+  if (!file) {
+    throw std::runtime_error("Hal_Trace can not open " + path);
+  }
+
+  size_t written = dump(file);
+
+  file.close();
+  if (!file) {
+    throw std::runtime_error("Hal_Trace can not write " + path);
+  }
+
+  return written;
+}
@@ -0,0 +1,95 @@
+/**
+ * This module implements Hal_Trace, a recorder of the individual items that
+ * move through the Hal pipes: every push, pop, and begin and end of a pipe
+ * task is recorded with a timestamp counter reading (TSC on x86) and the
+ * pipe name, in a lock free ring of the recording thread, so that a latency
+ * spike that the metrics histograms only count can be seen in place, e.g.
+ * which stage held the item and what its thread was doing meanwhile.
+ *
+ *   Hal_Trace::enable();
+ *   ... run the pipeline ...
+ *   Hal_Trace::dump("trace.json"); // open in ui.perfetto.dev or
+ *                                  // chrome://tracing
+ *
+ * Tracing is off by default, and then a trace point is a relaxed load and a
+ * branch. A ring keeps the last capacity events of its thread, the older
+ * ones are overwritten, and rings are kept after their thread ends, so a
+ * pipeline can be dumped after it is torn down, the ring of an ended thread
+ * is then freed by the dump (or clear).
+ */
+
+#ifndef HAL_TRACE_HPP_HAVE_SEEN
+
+#define HAL_TRACE_HPP_HAVE_SEEN
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+enum class Hal_TraceEvent : uint8_t { Push, Pop, ProcessBegin, ProcessEnd };
+
+class Hal_Trace {
+public:
+  static constexpr size_t kDefaultCapacity = size_t{1} << 16;
+
+  Hal_Trace() = delete;
+
+  /**
+   * Starts recording, capacity (rounded up to a power of 2) is the number
+   * of events kept per thread, for the rings of threads that have not
+   * recorded yet.
+   */
+  static void enable(size_t capacity = kDefaultCapacity);
+
+  static void disable();
+
+  static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+  /**
+   * The id of name for record, the same name always has the same id.
+   */
+  static uint32_t intern(std::string_view name);
+
+  static void record(uint32_t name, Hal_TraceEvent event,
+                     uint64_t count = 1) {
+    if (isEnabled()) {
+      append(name, event, count);
+    }
+  }
+
+  /**
+   * Drops the events recorded so far, and the rings of the ended threads.
+   */
+  static void clear();
+
+  /**
+   * Writes the events recorded so far as Chrome trace event JSON, a thread
+   * is named after its Hal_Proc. Threads may keep recording, the events
+   * that they overwrite meanwhile are left out, and the rings of the ended
+   * threads are freed once written. Returns the number of events written.
+   */
+  static size_t dump(std::ostream &os);
+
+  static size_t dump(const std::string &path);
+
+private:
+  struct Record;
+  struct Ring;
+  struct Event;
+  struct Recorder;
+  struct RingOwner;
+
+  static Recorder &getRecorder();
+  static Ring *addRing();
+  static void releaseEndedRings(Recorder &recorder);
+  static void append(uint32_t name, Hal_TraceEvent event, uint64_t count);
+  static void lock(Recorder &recorder);
+  static void unlock(Recorder &recorder);
+
+  static std::atomic<bool> s_enabled;
+};
+
+#endif /* HAL_TRACE_HPP_HAVE_SEEN */
@@ -0,0 +1,132 @@
+/**
+ * This module implements Hal_WaitStrategy, how a Hal_Buffer or
+ * Hal_LimitBuffer consumer waits for an item (and a Hal_LimitBuffer
+ * producer for free capacity):
+ *
+ * - Block parks the thread on the condition variable at once (the default),
+ *   each wakeup is then a futex sleep/wake round trip.
+ * - SpinThenPark first polls the buffer without its mutex for a bounded
+ *   number of spins, with a pause instruction between the polls, and only
+ *   parks if nothing arrives, so a bursty stream is picked up without a
+ *   kernel wakeup while an idle consumer still sleeps.
+ * - BusyPoll never parks, it is meant for a latency sensitive stage that
+ *   owns a dedicated core, and still sees a Hal_Proc stop request.
+ *
+ * On a single CPU the thread that would end the spin can not run while we
+ * spin, so SpinThenPark parks at once and BusyPoll yields the CPU between
+ * its polls.
+ */
+
+#ifndef HAL_WAIT_STRATEGY_HPP_HAVE_SEEN
+
+#define HAL_WAIT_STRATEGY_HPP_HAVE_SEEN
+
+#include "hal-proc.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+class Hal_WaitStrategy {
+public:
+  enum class Mode { Block, SpinThenPark, BusyPoll };
+
+  // a pause is 10 to 150 cycles depending on the CPU, so the default spins
+  // for roughly the cost of a futex wakeup before parking.
+  static constexpr unsigned kDefaultSpins = 1000;
+
+  constexpr Hal_WaitStrategy(Mode mode = Mode::Block,
+                             unsigned spins = kDefaultSpins)
+      : m_mode{mode}, m_spins{spins} {}
+
+  static constexpr Hal_WaitStrategy block() { return {Mode::Block}; }
+
+  static constexpr Hal_WaitStrategy
+  spinThenPark(unsigned spins = kDefaultSpins) {
+    return {Mode::SpinThenPark, spins};
+  }
+
+  static constexpr Hal_WaitStrategy busyPoll() { return {Mode::BusyPoll}; }
+
+  Mode getMode() const { return m_mode; }
+
+  unsigned getSpins() const { return m_spins; }
+
+  static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#endif
+  }
+
+  /**
+   * Polls ready() without any lock until it is true, or the spins are used
+   * up (never for Block, until true for BusyPoll), and returns ready().
+   */
+  template <typename Ready> bool spin(Ready ready) const {
+    bool singleCpu = isSingleCpu();
+
+    if (Mode::Block == m_mode || (Mode::SpinThenPark == m_mode && singleCpu)) {
+      return ready();
+    }
+
+    for (unsigned i = 0; Mode::BusyPoll == m_mode || i < m_spins; i++) {
+      if (ready()) {
+        return true;
+      }
+
+      // a busy poller never reaches Hal_Proc::condWait, so it checks for a
+      // stop request itself, but not on every poll.
+      if (0 == (i & (kStopCheckInterval - 1)) && Hal_Proc::stopRequested()) {
+        throw Hal_StopException{};
+      }
+
+      if (singleCpu) {
+        sched_yield();
+      } else {
+        pause();
+      }
+    }
+
+    return ready();
+  }
+
+  /**
+   * Called with the mutex held when the condition is not met, returns after
+   * a wakeup (or a poll that sees ready()) with the mutex held again, the
+   * caller re-checks its condition in a loop as for pthread_cond_wait.
+   */
+  template <typename Ready>
+  int park(pthread_cond_t *cond, pthread_mutex_t *mutex, Ready ready) const {
+    if (Mode::BusyPoll != m_mode) {
+      return Hal_Proc::condWait(cond, mutex);
+    }
+
+    int err = pthread_mutex_unlock(mutex);
+    if (err) {
+      return err;
+    }
+
+    spin(ready);
+
+    return pthread_mutex_lock(mutex);
+  }
+
+private:
+  static constexpr unsigned kStopCheckInterval = 64;
+
+  static bool isSingleCpu() {
+    static const bool singleCpu = sysconf(_SC_NPROCESSORS_ONLN) <= 1;
+
+    return singleCpu;
+  }
+
+  Mode m_mode{Mode::Block};
+  unsigned m_spins{kDefaultSpins};
+};
+
+#endif /* HAL_WAIT_STRATEGY_HPP_HAVE_SEEN */
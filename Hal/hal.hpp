@@ -2,10 +2,25 @@
 #define HAL_H_HAVE_SEEN
 
 #include "hal-async.hpp"
+#include "hal-broadcast-pipe.hpp"
 #include "hal-buffer.hpp"
+#include "hal-coro.hpp"
+#include "hal-executor.hpp"
+#include "hal-future.hpp"
+#include "hal-io-source.hpp"
 #include "hal-limit-buffer.hpp"
+#include "hal-metrics.hpp"
 #include "hal-pipe.hpp"
+#include "hal-pipeline.hpp"
+#include "hal-priority-buffer.hpp"
+#include "hal-priority-pipe.hpp"
 #include "hal-proc.hpp"
+#include "hal-ring-buffer.hpp"
+#include "hal-sharded-buffer.hpp"
+#include "hal-task.hpp"
 #include "hal-teepipe.hpp"
+#include "hal-timer.hpp"
+#include "hal-trace.hpp"
+#include "hal-wait-strategy.hpp"
 
 #endif /* HAL_H_HAVE_SEEN */